@@ -4,19 +4,129 @@
  * Copyright (c) 2014 Vedant Kumar <vsk@berkeley.edu>
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* MAP_ANONYMOUS, MAP_HUGETLB, MADV_HUGEPAGE */
+#endif
+
+#include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 #include "qf.h"
+#include "qf_core.h"
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define SMALL_PAGE_SIZE 4096UL
+
+/* Tables allocated with any of these flags are mmap()ed, not calloc()ed. */
+#define QF_MMAP_FLAGS (QF_HUGEPAGES | QF_HUGETLB | QF_PREFAULT)
+
+#ifndef QF_DEFAULT_FLAGS
+#define QF_DEFAULT_FLAGS 0
+#endif
+
+/* Size the overflow tail of a QF_NOWRAP table like ~10 * sqrt(2^q). */
+static uint64_t tail_slots(uint32_t q)
+{
+	uint64_t tail = 10ULL << ((q + 1) / 2);
+	return (tail + 63) & ~63ULL;
+}
+
+/* The length of an mmap()ed table: a whole number of huge pages. */
+static size_t mapping_bytes(struct quotient_filter *qf)
+{
+	return (table_bytes(qf) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+
+/*
+ * Map a zeroed table. Transparent huge pages need a 2MB-aligned range, so map
+ * an extra huge page and trim the unaligned head and tail.
+ */
+static uint64_t *map_table(struct quotient_filter *qf)
+{
+	size_t len = mapping_bytes(qf);
+	int prot = PROT_READ | PROT_WRITE;
+	int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+	char *p;
+
+	if (qf->qf_flags & QF_HUGETLB) {
+#ifdef MAP_HUGETLB
+		p = (char *) mmap(NULL, len, prot, mflags | MAP_HUGETLB, -1, 0);
+		if (p == MAP_FAILED) {
+			return NULL;
+		}
+#else
+		return NULL;
+#endif
+	} else {
+		char *raw = (char *) mmap(NULL, len + HUGE_PAGE_SIZE, prot,
+				mflags, -1, 0);
+		if (raw == MAP_FAILED) {
+			return NULL;
+		}
+		p = (char *) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1) &
+				~(HUGE_PAGE_SIZE - 1));
+		if (p != raw) {
+			munmap(raw, p - raw);
+		}
+		munmap(p + len, (raw + HUGE_PAGE_SIZE) - p);
+	}
+
+#ifdef MADV_HUGEPAGE
+	if (qf->qf_flags & QF_HUGEPAGES) {
+		/* Only a hint: THP may be disabled system-wide. */
+		madvise(p, len, MADV_HUGEPAGE);
+	}
+#endif
+
+	if (qf->qf_flags & QF_PREFAULT) {
+		for (size_t off = 0; off < len; off += SMALL_PAGE_SIZE) {
+			((volatile char *) p)[off] = 0;
+		}
+	}
+	return (uint64_t *) p;
+}
 
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define LOW_MASK(n) ((1ULL << (n)) - 1ULL)
+/* Carry the fields which callers may set over to qf's replacement, out. */
+static void keep_settings(struct quotient_filter *out,
+		struct quotient_filter *qf)
+{
+	out->qf_prefetch = qf->qf_prefetch;
+	out->qf_max_load = qf->qf_max_load;
+	out->qf_grow_policy = qf->qf_grow_policy;
+	out->qf_grows = qf->qf_grows;
+	out->qf_on_grow = qf->qf_on_grow;
+	out->qf_grow_arg = qf->qf_grow_arg;
+}
 
 bool qf_init(struct quotient_filter *qf, uint32_t q, uint32_t r)
+{
+	return qf_init_flags(qf, q, r, QF_DEFAULT_FLAGS);
+}
+
+/*
+ * Set up every field of qf for a (q, r) table with the given flags, except
+ * for the table itself. Returns false if the arguments are invalid.
+ */
+static bool init_shape(struct quotient_filter *qf, uint32_t q, uint32_t r,
+		uint32_t flags)
 {
 	if (q == 0 || r == 0 || q + r > 64) {
 		return false;
 	}
+	if ((flags & ~(QF_BLOCKED | QF_PLANES | QF_NOWRAP | QF_EXPANDABLE |
+				QF_COUNTING | QF_MMAP_FLAGS)) ||
+			((flags & QF_BLOCKED) && (flags & QF_PLANES)) ||
+			((flags & QF_EXPANDABLE) && (flags & QF_COUNTING)) ||
+			((flags & (QF_EXPANDABLE | QF_COUNTING)) && r < 2)) {
+		return false;
+	}
 
 	qf->qf_qbits = q;
 	qf->qf_rbits = r;
@@ -25,427 +135,1775 @@ bool qf_init(struct quotient_filter *qf, uint32_t q, uint32_t r)
 	qf->qf_rmask = LOW_MASK(r);
 	qf->qf_elem_mask = LOW_MASK(qf->qf_elem_bits);
 	qf->qf_entries = 0; 
-	qf->qf_max_size = 1 << q;
-	qf->qf_table = (uint64_t *) calloc(qf_table_size(q, r), 1);
-	return qf->qf_table != NULL;
+	qf->qf_max_size = 1ULL << q;
+	qf->qf_nslots = qf->qf_max_size;
+	if (flags & QF_NOWRAP) {
+		qf->qf_nslots += tail_slots(q);
+	}
+	qf->qf_flags = flags;
+	qf->qf_prefetch = QF_PREFETCH_DISTANCE;
+	qf->qf_old = NULL;
+	qf->qf_migrated = 0;
+	qf->qf_max_load = 0;
+	qf->qf_grow_policy = QF_GROW_INCREMENTAL;
+	qf->qf_grows = 0;
+	qf->qf_on_grow = NULL;
+	qf->qf_grow_arg = NULL;
+	if (flags & QF_BLOCKED) {
+		qf->qf_store = STORE_BLOCKED;
+	} else if (flags & QF_PLANES) {
+		qf->qf_store = STORE_PLANES;
+	} else if (qf->qf_elem_bits == 8) {
+		qf->qf_store = STORE_8;
+	} else if (qf->qf_elem_bits == 16) {
+		qf->qf_store = STORE_16;
+	} else if (qf->qf_elem_bits == 32) {
+		qf->qf_store = STORE_32;
+	} else {
+		qf->qf_store = STORE_PACKED;
+	}
+	return true;
 }
 
-/* Return QF[idx] in the lower bits. */
-static uint64_t get_elem(struct quotient_filter *qf, uint64_t idx)
+bool qf_init_flags(struct quotient_filter *qf, uint32_t q, uint32_t r,
+		uint32_t flags)
 {
-	uint64_t elt = 0;
-	size_t bitpos = qf->qf_elem_bits * idx;
-	size_t tabpos = bitpos / 64;
-	size_t slotpos = bitpos % 64;
-	int spillbits = (slotpos + qf->qf_elem_bits) - 64;
-	elt = (qf->qf_table[tabpos] >> slotpos) & qf->qf_elem_mask;
-	if (spillbits > 0) {
-		++tabpos;
-		uint64_t x = qf->qf_table[tabpos] & LOW_MASK(spillbits);
-		elt |= x << (qf->qf_elem_bits - spillbits);
+	if (!init_shape(qf, q, r, flags)) {
+		return false;
+	}
+	if (flags & QF_MMAP_FLAGS) {
+		qf->qf_table = map_table(qf);
+	} else {
+		qf->qf_table = (uint64_t *) calloc(table_bytes(qf), 1);
 	}
-	return elt;
+	return qf->qf_table != NULL;
 }
 
-/* Store the lower bits of elt into QF[idx]. */
-static void set_elem(struct quotient_filter *qf, uint64_t idx, uint64_t elt)
+/*
+ * Returns the slot past the last fingerprint of a sorted hash array, laid out
+ * from slot 0 without wrapping, and sets *count to the number of distinct
+ * fingerprints. Returns UINT64_MAX if the hashes are not sorted.
+ */
+static uint64_t bulk_extent(struct quotient_filter *qf, const uint64_t *hashes,
+		size_t n, uint64_t *count)
 {
-	size_t bitpos = qf->qf_elem_bits * idx;
-	size_t tabpos = bitpos / 64;
-	size_t slotpos = bitpos % 64;
-	int spillbits = (slotpos + qf->qf_elem_bits) - 64;
-	elt &= qf->qf_elem_mask;
-	qf->qf_table[tabpos] &= ~(qf->qf_elem_mask << slotpos);
-	qf->qf_table[tabpos] |= elt << slotpos;
-	if (spillbits > 0) {
-		++tabpos;
-		qf->qf_table[tabpos] &= ~LOW_MASK(spillbits);
-		qf->qf_table[tabpos] |= elt >> (qf->qf_elem_bits - spillbits);
+	uint64_t pos = 0;
+	uint64_t pq = 0, pr = 0;
+
+	*count = 0;
+	for (size_t i = 0; i < n; ++i) {
+		uint64_t fq = hash_to_quotient(qf, hashes[i]);
+		uint64_t fr = hash_to_remainder(qf, hashes[i]);
+		if (i > 0 && (fq < pq || (fq == pq && fr < pr))) {
+			return UINT64_MAX;
+		}
+		if (i > 0 && fq == pq && fr == pr) {
+			continue;
+		}
+		if (i == 0 || fq != pq) {
+			pos = MAX(pos, fq);
+		}
+		++pos;
+		++*count;
+		pq = fq;
+		pr = fr;
 	}
+	return pos;
 }
 
-static inline uint64_t incr(struct quotient_filter *qf, uint64_t idx)
+/*
+ * Lay out the fingerprints of hashes[0, n), which start new runs at hashes[0],
+ * from the cursor pos on, like qf_bulk_load(). Only slots in [lo, hi) are
+ * written; positions past the end of the table count as slot nslots + s for
+ * the slot s they wrap around to.
+ */
+static void bulk_fill(struct quotient_filter *qf, const uint64_t *hashes,
+		size_t n, uint64_t pos, uint64_t lo, uint64_t hi)
 {
-	return (idx + 1) & qf->qf_index_mask;
-}
+	uint64_t pq = 0, pr = 0;
 
-static inline uint64_t decr(struct quotient_filter *qf, uint64_t idx)
-{
-	return (idx - 1) & qf->qf_index_mask;
-}
+	for (size_t i = 0; i < n; ++i) {
+		uint64_t fq = hash_to_quotient(qf, hashes[i]);
+		uint64_t fr = hash_to_remainder(qf, hashes[i]);
+		uint64_t entry = fr << 3;
 
-static inline int is_occupied(uint64_t elt)
-{
-	return elt & 1;
-}
+		if (i > 0 && fq == pq) {
+			if (fr == pr) {
+				continue;
+			}
+			entry = set_shifted(set_continuation(entry));
+		} else if (pos <= fq) {
+			pos = fq;
+			entry = set_occupied(entry);
+		} else {
+			/* Slot fq is behind the cursor: it is filled or wrapped. */
+			if (fq >= lo && fq < hi) {
+				set_elem(qf, fq, set_occupied(get_elem(qf, fq)));
+			}
+			entry = set_shifted(entry);
+		}
+		if (pos >= hi && fq >= hi) {
+			return;
+		}
 
-static inline uint64_t set_occupied(uint64_t elt)
-{
-	return elt | 1;
+		if (pos >= lo && pos < hi) {
+			if (pos < qf->qf_nslots) {
+				set_elem(qf, pos, entry);
+			} else {
+				uint64_t s = pos - qf->qf_nslots;
+				set_elem(qf, s, slot_occupied(qf, s) ?
+						set_occupied(entry) : entry);
+			}
+		}
+		++pos;
+		pq = fq;
+		pr = fr;
+	}
 }
 
-static inline uint64_t clr_occupied(uint64_t elt)
+/*
+ * The slots past the end of a wrapping table continue at slot 0, so the first
+ * `wrap' slots are kept for them, and the runs which start there are shifted
+ * past them. Returns UINT64_MAX if a table which ends at slot `end' without
+ * wrapping cannot hold count fingerprints.
+ */
+static uint64_t bulk_wrap(struct quotient_filter *qf, uint64_t count,
+		uint64_t end)
 {
-	return elt & ~1;
+	if (count > qf->qf_max_size ||
+			((qf->qf_flags & QF_NOWRAP) && end > qf->qf_nslots)) {
+		return UINT64_MAX;
+	}
+	return end > qf->qf_nslots ? end - qf->qf_nslots : 0;
 }
 
-static inline int is_continuation(uint64_t elt)
+bool qf_bulk_load(struct quotient_filter *qf, const uint64_t *hashes,
+		size_t n)
 {
-	return elt & 2;
-}
+	uint64_t count;
+	qf_expand_finish(qf);
+	if (qf->qf_entries != 0 ||
+			(qf->qf_flags & (QF_EXPANDABLE | QF_COUNTING))) {
+		return false;
+	}
+	uint64_t end = bulk_extent(qf, hashes, n, &count);
+	if (end == UINT64_MAX) {
+		return false;
+	}
+	uint64_t wrap = bulk_wrap(qf, count, end);
+	if (wrap == UINT64_MAX) {
+		return false;
+	}
 
-static inline uint64_t set_continuation(uint64_t elt)
-{
-	return elt | 2;
+	bulk_fill(qf, hashes, n, wrap, 0, UINT64_MAX);
+	qf->qf_entries = count;
+	return true;
 }
 
-static inline uint64_t clr_continuation(uint64_t elt)
+/*
+ * qf_bulk_build() sorts the fingerprints by their top bits into buckets, each
+ * covering a range of 64-slot aligned quotients, then finishes every bucket
+ * with an LSD radix sort. Thread t owns a range of buckets throughout.
+ */
+#define BULK_BUCKET_BITS 10
+#define BULK_DIGIT_BITS 8
+
+struct bulk_build;
+
+struct bulk_thread {
+	struct bulk_build *b;
+	pthread_t tid;
+	uint32_t t;
+	uint64_t count;		/* Distinct fingerprints in its buckets. */
+	uint64_t end;		/* Where they end if laid out from slot 0. */
+	uint64_t start;		/* The cursor its runs are laid out from. */
+	uint64_t lo;		/* The first slot it may write in parallel. */
+	uint64_t stop;		/* The cursor past its last run. */
+	uint64_t resume;	/* A merge's first fingerprint left to insert. */
+	bool spilled;		/* Whether a merge left any. */
+	bool ok;
+};
+
+struct merge_source;
+
+struct bulk_build {
+	struct quotient_filter *qf;
+	uint64_t *hashes;
+	uint64_t *tmp;
+	size_t n;
+	uint32_t nthreads;
+	uint32_t nbuckets;
+	uint32_t shift;		/* fingerprint >> shift is its bucket. */
+	uint64_t fmask;		/* The lowest q+r bits. */
+	size_t *offsets;	/* nthreads x nbuckets scatter offsets. */
+	size_t *bounds;		/* Bucket b is hashes[bounds[b], bounds[b+1]). */
+	struct bulk_thread *threads;
+	struct quotient_filter *const *qfs;	/* The inputs of a merge. */
+	size_t k;
+	struct merge_source *sources;	/* nthreads x k merge sources. */
+	struct merge_source **heaps;
+	uint64_t *ends;		/* The slot past each input's last entry. */
+};
+
+/* The input range of thread t, for the bucket scatter. */
+static inline size_t bulk_input(struct bulk_build *b, uint32_t t)
 {
-	return elt & ~2;
+	return (size_t) ((uint64_t) b->n * t / b->nthreads);
 }
 
-static inline int is_shifted(uint64_t elt)
+/* The first bucket of thread t. */
+static inline uint32_t bulk_bucket(struct bulk_build *b, uint32_t t)
 {
-	return elt & 4;
+	return (uint32_t) ((uint64_t) b->nbuckets * t / b->nthreads);
 }
 
-static inline uint64_t set_shifted(uint64_t elt)
+static void *bulk_count(void *arg)
 {
-	return elt | 4;
-}
+	struct bulk_thread *bt = (struct bulk_thread *) arg;
+	struct bulk_build *b = bt->b;
+	size_t *cnt = b->offsets + (size_t) bt->t * b->nbuckets;
 
-static inline uint64_t clr_shifted(uint64_t elt)
-{
-	return elt & ~4;
+	for (size_t i = bulk_input(b, bt->t); i < bulk_input(b, bt->t + 1);
+			++i) {
+		++cnt[(b->hashes[i] & b->fmask) >> b->shift];
+	}
+	return NULL;
 }
 
-static inline uint64_t get_remainder(uint64_t elt)
+static void *bulk_scatter(void *arg)
 {
-	return elt >> 3;
+	struct bulk_thread *bt = (struct bulk_thread *) arg;
+	struct bulk_build *b = bt->b;
+	size_t *off = b->offsets + (size_t) bt->t * b->nbuckets;
+
+	for (size_t i = bulk_input(b, bt->t); i < bulk_input(b, bt->t + 1);
+			++i) {
+		uint64_t fp = b->hashes[i] & b->fmask;
+		b->tmp[off[fp >> b->shift]++] = fp;
+	}
+	return NULL;
 }
 
-static inline bool is_empty_element(uint64_t elt)
+/* Radix sort each bucket of the thread from tmp back into hashes. */
+static void *bulk_sort(void *arg)
 {
-	return (elt & 7) == 0;
+	struct bulk_thread *bt = (struct bulk_thread *) arg;
+	struct bulk_build *b = bt->b;
+	size_t cnt[1 << BULK_DIGIT_BITS];
+
+	for (uint32_t k = bulk_bucket(b, bt->t);
+			k < bulk_bucket(b, bt->t + 1); ++k) {
+		size_t len = b->bounds[k + 1] - b->bounds[k];
+		uint64_t *src = b->tmp + b->bounds[k];
+		uint64_t *dst = b->hashes + b->bounds[k];
+
+		for (uint32_t d = 0; d < b->shift; d += BULK_DIGIT_BITS) {
+			memset(cnt, 0, sizeof(cnt));
+			for (size_t i = 0; i < len; ++i) {
+				++cnt[(src[i] >> d) & LOW_MASK(BULK_DIGIT_BITS)];
+			}
+			size_t sum = 0;
+			for (size_t v = 0; v < (1 << BULK_DIGIT_BITS); ++v) {
+				size_t c = cnt[v];
+				cnt[v] = sum;
+				sum += c;
+			}
+			for (size_t i = 0; i < len; ++i) {
+				uint64_t v = (src[i] >> d) &
+					LOW_MASK(BULK_DIGIT_BITS);
+				dst[cnt[v]++] = src[i];
+			}
+			uint64_t *swap = src;
+			src = dst;
+			dst = swap;
+		}
+		if (src != b->hashes + b->bounds[k]) {
+			memcpy(b->hashes + b->bounds[k], src,
+					len * sizeof(uint64_t));
+		}
+	}
+	return NULL;
 }
 
-static inline bool is_cluster_start(uint64_t elt)
+static void *bulk_measure(void *arg)
 {
-	return is_occupied(elt) && !is_continuation(elt) && !is_shifted(elt);
+	struct bulk_thread *bt = (struct bulk_thread *) arg;
+	struct bulk_build *b = bt->b;
+	size_t first = b->bounds[bulk_bucket(b, bt->t)];
+	size_t last = b->bounds[bulk_bucket(b, bt->t + 1)];
+
+	bt->end = bulk_extent(b->qf, b->hashes + first, last - first,
+			&bt->count);
+	return NULL;
 }
 
-static inline bool is_run_start(uint64_t elt)
+static void *bulk_write(void *arg)
 {
-	return !is_continuation(elt) && (is_occupied(elt) || is_shifted(elt));
+	struct bulk_thread *bt = (struct bulk_thread *) arg;
+	struct bulk_build *b = bt->b;
+	size_t first = b->bounds[bulk_bucket(b, bt->t)];
+	size_t last = b->bounds[bulk_bucket(b, bt->t + 1)];
+
+	bulk_fill(b->qf, b->hashes + first, last - first, bt->start, bt->lo,
+			b->qf->qf_nslots);
+	return NULL;
 }
 
-static inline uint64_t hash_to_quotient(struct quotient_filter *qf,
-		uint64_t hash)
+/* Run fn on every thread, or in the caller if a thread cannot be started. */
+static void bulk_run(struct bulk_build *b, void *(*fn)(void *))
 {
-	return (hash >> qf->qf_rbits) & qf->qf_index_mask;
+	for (uint32_t t = 1; t < b->nthreads; ++t) {
+		if (pthread_create(&b->threads[t].tid, NULL, fn,
+					&b->threads[t]) != 0) {
+			b->threads[t].tid = pthread_self();
+			fn(&b->threads[t]);
+		}
+	}
+	fn(&b->threads[0]);
+	for (uint32_t t = 1; t < b->nthreads; ++t) {
+		if (!pthread_equal(b->threads[t].tid, pthread_self())) {
+			pthread_join(b->threads[t].tid, NULL);
+		}
+	}
 }
 
-static inline uint64_t hash_to_remainder(struct quotient_filter *qf,
-		uint64_t hash)
+/* Sort the fingerprints of b->hashes in place, by (quotient, remainder). */
+static void bulk_radix_sort(struct bulk_build *b)
 {
-	return hash & qf->qf_rmask;
+	bulk_run(b, bulk_count);
+
+	size_t sum = 0;
+	for (uint32_t k = 0; k < b->nbuckets; ++k) {
+		b->bounds[k] = sum;
+		for (uint32_t t = 0; t < b->nthreads; ++t) {
+			size_t *cnt = b->offsets + (size_t) t * b->nbuckets + k;
+			size_t c = *cnt;
+			*cnt = sum;
+			sum += c;
+		}
+	}
+	b->bounds[b->nbuckets] = sum;
+
+	bulk_run(b, bulk_scatter);
+	bulk_run(b, bulk_sort);
 }
 
-/* Find the start index of the run for fq (given that the run exists). */
-static uint64_t find_run_index(struct quotient_filter *qf, uint64_t fq)
+/*
+ * Lay out the sorted fingerprints. Thread t fills the slots from the first
+ * quotient of its buckets, or from the end of the previous thread's runs if
+ * they spill past it, rounded up to a whole word of slots: no two threads
+ * then write the same table word. The slots that spill are filled afterwards.
+ */
+static bool bulk_layout(struct bulk_build *b)
 {
-	/* Find the start of the cluster. */
-	uint64_t b = fq;
-	while (is_shifted(get_elem(qf, b))) {
-		b = decr(qf, b);
+	struct quotient_filter *qf = b->qf;
+
+	bulk_run(b, bulk_measure);
+
+	uint64_t count = 0, end = 0;
+	for (uint32_t t = 0; t < b->nthreads; ++t) {
+		count += b->threads[t].count;
+		end = MAX(end + b->threads[t].count, b->threads[t].end);
+	}
+	uint64_t wrap = bulk_wrap(qf, count, end);
+	if (wrap == UINT64_MAX) {
+		return false;
 	}
 
-	/* Find the start of the run for fq. */
-	uint64_t s = b;
-	while (b != fq) {
-		do {
-			s = incr(qf, s);
-		} while (is_continuation(get_elem(qf, s)));
+	uint64_t pos = wrap;
+	for (uint32_t t = 0; t < b->nthreads; ++t) {
+		struct bulk_thread *bt = &b->threads[t];
+		uint64_t first = (uint64_t) bulk_bucket(b, t) <<
+			(b->shift - qf->qf_rbits);
+		bt->start = pos;
+		bt->lo = MAX(first, (pos + 63) & ~63ULL);
+		pos = MAX(pos + bt->count, bt->end);
+		bt->stop = pos;
+	}
 
-		do {
-			b = incr(qf, b);
-		} while (!is_occupied(get_elem(qf, b)));
+	bulk_run(b, bulk_write);
+
+	/* Fill the spilled slots, then anything that wrapped around. */
+	for (uint32_t t = 0; t < b->nthreads; ++t) {
+		struct bulk_thread *bt = &b->threads[t];
+		size_t first = b->bounds[bulk_bucket(b, t)];
+		size_t last = b->bounds[bulk_bucket(b, t + 1)];
+		bulk_fill(qf, b->hashes + first, last - first, bt->start, 0,
+				bt->lo);
+		if (bt->stop > qf->qf_nslots) {
+			bulk_fill(qf, b->hashes + first, last - first,
+					bt->start, qf->qf_nslots, UINT64_MAX);
+		}
 	}
-	return s;
+
+	qf->qf_entries = count;
+	return true;
 }
 
-/* Insert elt into QF[s], shifting over elements as necessary. */
-static void insert_into(struct quotient_filter *qf, uint64_t s, uint64_t elt)
+/*
+ * Set up b to lay out n sorted fingerprints into qf on up to nthreads
+ * threads, each owning a range of buckets.
+ */
+static bool bulk_init(struct bulk_build *b, struct quotient_filter *qf,
+		uint64_t *hashes, size_t n, uint32_t nthreads)
 {
-	uint64_t prev;
-	uint64_t curr = elt;
-	bool empty;
+	/* Buckets must cover whole words of slots, hence q - 6 bits. */
+	uint32_t bits = qf->qf_qbits > 6 ? qf->qf_qbits - 6 : 0;
+	if (bits > BULK_BUCKET_BITS) {
+		bits = BULK_BUCKET_BITS;
+	}
+	memset(b, 0, sizeof(*b));
+	b->qf = qf;
+	b->hashes = hashes;
+	b->n = n;
+	b->nbuckets = 1U << bits;
+	b->nthreads = nthreads == 0 ? 1 : nthreads;
+	if (b->nthreads > b->nbuckets) {
+		b->nthreads = b->nbuckets;
+	}
+	b->shift = qf->qf_qbits + qf->qf_rbits - bits;
+	b->fmask = (qf->qf_index_mask << qf->qf_rbits) | qf->qf_rmask;
+	b->bounds = (size_t *) malloc((b->nbuckets + 1) * sizeof(size_t));
+	b->threads = (struct bulk_thread *) calloc(b->nthreads,
+			sizeof(struct bulk_thread));
+	if (!b->bounds || !b->threads) {
+		return false;
+	}
+	for (uint32_t t = 0; t < b->nthreads; ++t) {
+		b->threads[t].b = b;
+		b->threads[t].t = t;
+	}
+	return true;
+}
 
-	do {
-		prev = get_elem(qf, s);
-		empty = is_empty_element(prev);
-		if (!empty) {
-			/* Fix up `is_shifted' and `is_occupied'. */
-			prev = set_shifted(prev);
-			if (is_occupied(prev)) {
-				curr = set_occupied(curr);
-				prev = clr_occupied(prev);
-			}
-		}
-		set_elem(qf, s, curr);
-		curr = prev;
-		s = incr(qf, s);
-	} while (!empty);
+static void bulk_free(struct bulk_build *b)
+{
+	free(b->tmp);
+	free(b->offsets);
+	free(b->bounds);
+	free(b->threads);
 }
 
-bool qf_insert(struct quotient_filter *qf, uint64_t hash)
+bool qf_bulk_build(struct quotient_filter *qf, uint64_t *hashes, size_t n,
+		uint32_t nthreads)
 {
-	if (qf->qf_entries >= qf->qf_max_size) {
+	qf_expand_finish(qf);
+	if (qf->qf_entries != 0 ||
+			(qf->qf_flags & (QF_EXPANDABLE | QF_COUNTING))) {
 		return false;
 	}
+	/* Nothing to sort, and hashes may be NULL. */
+	if (n == 0) {
+		return true;
+	}
 
-	uint64_t fq = hash_to_quotient(qf, hash);
-	uint64_t fr = hash_to_remainder(qf, hash);
-	uint64_t T_fq = get_elem(qf, fq);
-	uint64_t entry = (fr << 3) & ~7;
+	struct bulk_build b;
+	bool ok = bulk_init(&b, qf, hashes, n, nthreads);
+	if (ok) {
+		b.tmp = (uint64_t *) malloc(n * sizeof(uint64_t));
+		b.offsets = (size_t *) calloc((size_t) b.nthreads * b.nbuckets,
+				sizeof(size_t));
+		ok = b.tmp && b.offsets;
+	}
+	if (ok) {
+		bulk_radix_sort(&b);
+		ok = bulk_layout(&b);
+	}
+	bulk_free(&b);
+	return ok;
+}
 
-	/* Special-case filling canonical slots to simplify insert_into(). */
-	if (is_empty_element(T_fq)) {
-		set_elem(qf, fq, set_occupied(entry));
-		++qf->qf_entries;
-		return true;
+/* Start loading the cache lines of slot idx that a lookup reads first. */
+static inline void prefetch_slot(struct quotient_filter *qf, uint64_t idx)
+{
+	switch (qf->qf_store) {
+	case STORE_BLOCKED:
+		/* The metadata words, then the slot's remainder. */
+		__builtin_prefetch(get_block(qf, idx));
+		__builtin_prefetch(get_block(qf, idx) + REMAINDERS +
+				(idx % 64) * qf->qf_rbits / 64);
+		break;
+	case STORE_PLANES:
+		__builtin_prefetch(seq_word(qf, OCCUPIEDS, idx / 64));
+		__builtin_prefetch(seq_word(qf, REMAINDERS,
+				idx * qf->qf_rbits / 64));
+		break;
+	default:
+		__builtin_prefetch(qf->qf_table + idx * qf->qf_elem_bits / 64);
+		break;
 	}
+}
 
-	if (!is_occupied(T_fq)) {
-		set_elem(qf, fq, set_occupied(T_fq));
+uint64_t qf_count(struct quotient_filter *qf, uint64_t hash)
+{
+	if (qf->qf_flags & QF_COUNTING) {
+		return count_hash(qf, hash);
 	}
+	return qf_may_contain(qf, hash);
+}
 
-	uint64_t start = find_run_index(qf, fq);
-	uint64_t s = start;
+/* Whether the hash's quotient in qf->qf_old has been moved into qf. */
+static inline bool is_migrated(struct quotient_filter *qf, uint64_t hash)
+{
+	return home_slot(qf->qf_old, hash) < qf->qf_migrated;
+}
 
-	if (is_occupied(T_fq)) {
-		/* Move the cursor to the insert position in the fq run. */
-		do {
-			uint64_t rem = get_remainder(get_elem(qf, s));
-			if (rem == fr) {
-				return true;
-			} else if (rem > fr) {
-				break;
-			}
-			s = incr(qf, s);
-		} while (is_continuation(get_elem(qf, s)));
+/*
+ * Where the entry (quot, rem) of a QF_EXPANDABLE table goes in the table it
+ * expands into, which has one more quotient and remainder bit: the top bit of
+ * the fingerprint joins the quotient, and the rest moves up past two zeros.
+ */
+static inline uint64_t age_move_quotient(struct quotient_filter *qf,
+		uint64_t quot, uint64_t rem)
+{
+	return (quot << 1) | (rem >> (qf->qf_rbits - 1));
+}
 
-		if (s == start) {
-			/* The old start-of-run becomes a continuation. */
-			uint64_t old_head = get_elem(qf, start);
-			set_elem(qf, start, set_continuation(old_head));
-		} else {
-			/* The new element becomes a continuation. */
-			entry = set_continuation(entry);
-		}
-	}
+static inline uint64_t age_move_remainder(struct quotient_filter *qf,
+		uint64_t rem)
+{
+	return (rem & (qf->qf_rmask >> 1)) << 2;
+}
 
-	/* Set the shifted bit if we can't use the canonical slot. */
-	if (s != fq) {
-		entry = set_shifted(entry);
+/*
+ * Insert the entry (quot, rem) of old, the QF_EXPANDABLE table which qf is
+ * expanding out of. An entry with no fingerprint bits left goes into both
+ * new quotients.
+ */
+static bool age_move(struct quotient_filter *qf, struct quotient_filter *old,
+		uint64_t quot, uint64_t rem)
+{
+	if (age_empty(old, rem)) {
+		return insert_entry(qf, quot << 1, rem << 1) &&
+			insert_entry(qf, (quot << 1) | 1, rem << 1);
 	}
-
-	insert_into(qf, s, entry);
-	++qf->qf_entries;
-	return true;
+	return insert_entry(qf, age_move_quotient(old, quot, rem),
+			age_move_remainder(old, rem));
 }
 
-bool qf_may_contain(struct quotient_filter *qf, uint64_t hash)
+/*
+ * Move the runs of the next quotients of qf->qf_old into qf, until at least n
+ * entries have moved or `skip' empty quotients have been stepped over, and
+ * free the old table once it is drained. Its entries stay where they are, but
+ * are no longer counted or looked up.
+ */
+static void migrate(struct quotient_filter *qf, uint64_t n, uint64_t skip)
 {
-	uint64_t fq = hash_to_quotient(qf, hash);
-	uint64_t fr = hash_to_remainder(qf, hash);
-	uint64_t T_fq = get_elem(qf, fq);
+	struct quotient_filter *old = qf->qf_old;
+	uint64_t quot = qf->qf_migrated;
+
+	for (; n > 0 && skip > 0 && quot <= old->qf_index_mask &&
+			old->qf_entries > 0; ++quot) {
+		if (!slot_occupied(old, quot)) {
+			--skip;
+			continue;
+		}
+		uint64_t s = find_run_index(old, quot);
+		do {
+			uint64_t rem = get_remainder(get_elem(old, s));
+			bool moved;
+			/* The entry is already counted in qf. */
+			--qf->qf_entries;
+			--old->qf_entries;
+			if (old->qf_flags & QF_EXPANDABLE) {
+				moved = age_move(qf, old, quot, rem);
+			} else {
+				moved = insert_hash(qf,
+						(quot << old->qf_rbits) | rem);
+			}
+			/*
+			 * The new table has twice the slots of the old one,
+			 * and insert_expanding() keeps a slot spare for the
+			 * second copy an old QF_EXPANDABLE entry may need.
+			 */
+			assert(moved);
+			(void) moved;
+			n -= n > 0;
+			s = incr(old, s);
+		} while (is_continuation(get_elem(old, s)));
+	}
 
-	/* If this quotient has no run, give up. */
-	if (!is_occupied(T_fq)) {
-		return false;
+	qf->qf_migrated = quot;
+	if (quot > old->qf_index_mask || old->qf_entries == 0) {
+		qf_destroy(old);
+		free(old);
+		qf->qf_old = NULL;
+		qf->qf_migrated = 0;
 	}
+}
 
-	/* Scan the sorted run for the target remainder. */
-	uint64_t s = find_run_index(qf, fq);
-	do {
-		uint64_t rem = get_remainder(get_elem(qf, s));
-		if (rem == fr) {
+static bool insert_expanding(struct quotient_filter *qf, uint64_t hash)
+{
+	if (qf->qf_old) {
+		migrate(qf, QF_MIGRATE_ENTRIES, QF_MIGRATE_QUOTIENTS);
+		/* QF_EXPANDABLE tables keep an entry for each hash. */
+		if (qf->qf_old && !is_migrated(qf, hash) &&
+				!(qf->qf_flags & QF_EXPANDABLE) &&
+				lookup_hash(qf->qf_old, hash)) {
 			return true;
-		} else if (rem > fr) {
+		}
+		/*
+		 * An old QF_EXPANDABLE entry may move into two slots, so keep
+		 * a slot spare for each one which has yet to move.
+		 */
+		if (qf->qf_old && (qf->qf_flags & QF_EXPANDABLE) &&
+				qf->qf_entries + qf->qf_old->qf_entries >=
+				qf->qf_max_size) {
 			return false;
 		}
-		s = incr(qf, s);
-	} while (is_continuation(get_elem(qf, s)));
-	return false;
+	}
+	return insert_hash(qf, hash);
 }
 
-/* Remove the entry in QF[s] and slide the rest of the cluster forward. */
-static void delete_entry(struct quotient_filter *qf, uint64_t s, uint64_t quot)
+/* Expand qf on behalf of qf_insert(), as its qf_grow_policy says. */
+static bool grow(struct quotient_filter *qf)
 {
-	uint64_t next;
-	uint64_t curr = get_elem(qf, s);
-	uint64_t sp = incr(qf, s);
-	uint64_t orig = s;
-
-	/*
-	 * FIXME(vsk): This loop looks ugly. Rewrite.
-	 */
-	while (true) {
-		next = get_elem(qf, sp);
-		bool curr_occupied = is_occupied(curr);
-
-		if (is_empty_element(next) || is_cluster_start(next) || sp == orig) {
-			set_elem(qf, s, 0);
-			return;
-		} else {
-			/* Fix entries which slide into canonical slots. */
-			uint64_t updated_next = next;
-			if (is_run_start(next)) {
-				do {
-					quot = incr(qf, quot);
-				} while (!is_occupied(get_elem(qf, quot)));
-
-				if (curr_occupied && quot == s) {
-					updated_next = clr_shifted(next);
-				}
-			}
-
-			set_elem(qf, s, curr_occupied ?
-					set_occupied(updated_next) :
-					clr_occupied(updated_next));
-			s = sp;
-			sp = incr(qf, sp);
-			curr = next;
+	bool ok;
+	if (qf->qf_grow_policy == QF_GROW_INCREMENTAL &&
+			!(qf->qf_flags & QF_NOWRAP)) {
+		qf_expand_finish(qf);
+		ok = qf_expand_begin(qf);
+	} else {
+		ok = qf_expand(qf);
+	}
+	if (ok) {
+		++qf->qf_grows;
+		if (qf->qf_on_grow) {
+			qf->qf_on_grow(qf, qf->qf_grow_arg);
 		}
 	}
+	return ok;
 }
 
-bool qf_remove(struct quotient_filter *qf, uint64_t hash)
+bool qf_insert(struct quotient_filter *qf, uint64_t hash)
 {
-	uint64_t highbits = hash >> (qf->qf_qbits + qf->qf_rbits);
-	if (highbits) {
-		return false;
+	double limit = qf->qf_max_load * qf->qf_max_size;
+	if (qf->qf_max_load > 0 && qf->qf_entries + 1 > limit) {
+		grow(qf);
 	}
-
-	uint64_t fq = hash_to_quotient(qf, hash);
-	uint64_t fr = hash_to_remainder(qf, hash);
-	uint64_t T_fq = get_elem(qf, fq);
-
-	if (!is_occupied(T_fq) || !qf->qf_entries) {
+	if (insert_expanding(qf, hash)) {
 		return true;
 	}
+	/* A QF_NOWRAP tail may fill up below the load limit. */
+	return qf->qf_max_load > 0 && grow(qf) && insert_expanding(qf, hash);
+}
 
-	uint64_t start = find_run_index(qf, fq);
-	uint64_t s = start;
-	uint64_t rem;
-
-	/* Find the offending table index (or give up). */
-	do {
-		rem = get_remainder(get_elem(qf, s));
-		if (rem == fr) {
-			break;
-		} else if (rem > fr) {
+bool qf_may_contain(struct quotient_filter *qf, uint64_t hash)
+{
+	if (qf->qf_old) {
+		migrate(qf, QF_MIGRATE_ENTRIES, QF_MIGRATE_QUOTIENTS);
+		if (qf->qf_old && !is_migrated(qf, hash) &&
+				lookup_hash(qf->qf_old, hash)) {
 			return true;
 		}
-		s = incr(qf, s);
-	} while (is_continuation(get_elem(qf, s)));
-	if (rem != fr) {
-		return true;
 	}
+	return lookup_hash(qf, hash);
+}
 
-	uint64_t kill = (s == fq) ? T_fq : get_elem(qf, s);
-	bool replace_run_start = is_run_start(kill);
+/* How many hashes qf_may_contain_batch() takes through its stages at once. */
+#define BATCH_HASHES 64
 
-	/* If we're deleting the last entry in a run, clear `is_occupied'. */
-	if (is_run_start(kill)) {
-		uint64_t next = get_elem(qf, incr(qf, s));
-		if (!is_continuation(next)) {
-			T_fq = clr_occupied(T_fq);
-			set_elem(qf, fq, T_fq);
-		}
+/*
+ * The first stage of qf_may_contain_batch(): compute the canonical slots of
+ * the m hashes, and start loading those of the first `dist'.
+ */
+static void batch_plan(struct quotient_filter *qf, const uint64_t *hashes,
+		size_t m, size_t dist, uint64_t *slots)
+{
+	for (size_t j = 0; j < m; ++j) {
+		slots[j] = home_slot(qf, hashes[j]);
+	}
+	for (size_t j = 0; j < dist && j < m; ++j) {
+		prefetch_slot(qf, slots[j]);
+	}
+}
+
+void qf_may_contain_batch(struct quotient_filter *qf, const uint64_t *hashes,
+		size_t n, uint64_t *out)
+{
+	/* Move one step's worth of an expansion for the whole batch. */
+	struct quotient_filter *old = NULL;
+	if (qf->qf_old) {
+		migrate(qf, QF_MIGRATE_ENTRIES, QF_MIGRATE_QUOTIENTS);
+		old = qf->qf_old;
 	}
 
-	delete_entry(qf, s, fq);
+	size_t dist = MIN(qf->qf_prefetch, BATCH_HASHES);
+	uint64_t slots[2][BATCH_HASHES];
+	batch_plan(qf, hashes, MIN(n, BATCH_HASHES), dist, slots[0]);
+
+	for (size_t base = 0; base < n; base += BATCH_HASHES) {
+		const uint64_t *h = hashes + base;
+		const uint64_t *cur = slots[(base / BATCH_HASHES) % 2];
+		size_t m = MIN(n - base, BATCH_HASHES);
+
+		/*
+		 * Most negative lookups stop at the `is_occupied' bit. Test
+		 * them all while the slots dist ahead are being loaded.
+		 */
+		uint64_t maybe = 0;
+		for (size_t j = 0; j < m; ++j) {
+			if (j + dist < m) {
+				prefetch_slot(qf, cur[j + dist]);
+			}
+			maybe |= (uint64_t) slot_occupied(qf, cur[j]) << j;
+		}
 
-	if (replace_run_start) {
-		uint64_t next = get_elem(qf, s);
-		uint64_t updated_next = next;
-		if (is_continuation(next)) {
-			/* The new start-of-run is no longer a continuation. */
-			updated_next = clr_continuation(next);
+		/* Start on the next chunk before the run scans of this one. */
+		if (base + m < n) {
+			batch_plan(qf, h + m, MIN(n - base - m, BATCH_HASHES),
+					dist, slots[(base / BATCH_HASHES + 1) % 2]);
 		}
-		if (s == fq && is_run_start(updated_next)) {
-			/* The new start-of-run is in the canonical slot. */
-			updated_next = clr_shifted(updated_next);
+
+		uint64_t hits = 0;
+		for (uint64_t bits = maybe; bits; bits &= bits - 1) {
+			int j = __builtin_ctzll(bits);
+			hits |= (uint64_t) lookup_hash(qf, h[j]) << j;
 		}
-		if (updated_next != next) {
-			set_elem(qf, s, updated_next);
+
+		/* Hashes whose old quotient has not moved yet may be there. */
+		for (size_t j = 0; old && j < m; ++j) {
+			if (!((hits >> j) & 1) && !is_migrated(qf, h[j]) &&
+					lookup_hash(old, h[j])) {
+				hits |= 1ULL << j;
+			}
 		}
+		out[base / 64] = hits;
 	}
+}
 
-	--qf->qf_entries;
-	return true;
+bool qf_remove(struct quotient_filter *qf, uint64_t hash)
+{
+	if (qf->qf_old) {
+		migrate(qf, QF_MIGRATE_ENTRIES, QF_MIGRATE_QUOTIENTS);
+	}
+	if (qf->qf_old && !is_migrated(qf, hash)) {
+		uint64_t entries = qf->qf_entries;
+		/* New QF_EXPANDABLE fingerprints are longer than old ones. */
+		if (qf->qf_flags & QF_EXPANDABLE) {
+			remove_hash(qf, hash);
+			if (qf->qf_entries < entries) {
+				return true;
+			}
+		}
+		entries = qf->qf_old->qf_entries;
+		remove_hash(qf->qf_old, hash);
+		if (qf->qf_old->qf_entries < entries) {
+			--qf->qf_entries;
+			return true;
+		}
+	}
+	return remove_hash(qf, hash);
 }
 
-bool qf_merge(struct quotient_filter *qf1, struct quotient_filter *qf2,
-		struct quotient_filter *qfout)
+bool qf_expand_begin(struct quotient_filter *qf)
 {
-	uint32_t q = 1 + MAX(qf1->qf_qbits, qf2->qf_qbits);
-	uint32_t r = MAX(qf1->qf_rbits, qf2->qf_rbits);
-	if (!qf_init(qfout, q, r)) {
+	if (qf->qf_old || qf->qf_rbits < 2 ||
+			(qf->qf_flags & (QF_NOWRAP | QF_COUNTING))) {
+		return false;
+	}
+	struct quotient_filter *old = (struct quotient_filter *)
+		malloc(sizeof(*old));
+	if (!old) {
 		return false;
 	}
 
-	struct qf_iterator qfi;
-	qfi_start(qf1, &qfi);
-	while (!qfi_done(qf1, &qfi)) {
-		qf_insert(qfout, qfi_next(qf1, &qfi));
+	struct quotient_filter out;
+	uint32_t r = qf->qf_rbits;
+	if (qf->qf_flags & QF_EXPANDABLE) {
+		++r;
+	} else {
+		--r;
+	}
+	if (!qf_init_flags(&out, qf->qf_qbits + 1, r, qf->qf_flags)) {
+		free(old);
+		return false;
 	}
-	qfi_start(qf2, &qfi);
-	while (!qfi_done(qf2, &qfi)) {
-		qf_insert(qfout, qfi_next(qf2, &qfi));
+	keep_settings(&out, qf);
+	out.qf_entries = qf->qf_entries;
+	*old = *qf;
+	*qf = out;
+	if (old->qf_entries == 0) {
+		qf_destroy(old);
+		free(old);
+	} else {
+		qf->qf_old = old;
 	}
 	return true;
 }
 
-void qf_clear(struct quotient_filter *qf)
+void qf_expand_finish(struct quotient_filter *qf)
 {
-	qf->qf_entries = 0;
-	memset(qf->qf_table, 0, qf_table_size(qf->qf_qbits, qf->qf_rbits));
+	while (qf->qf_old) {
+		migrate(qf, UINT64_MAX, UINT64_MAX);
+	}
 }
 
-size_t qf_table_size(uint32_t q, uint32_t r)
-{
-	size_t bits = (1 << q) * (r + 3);
-	size_t bytes = bits / 8;
-	return (bits % 8) ? (bytes + 1) : bytes;
-}
+/*
+ * Appends fingerprints in ascending order to a QF which starts out empty,
+ * writing each slot once. Fingerprints which would land past the end of the
+ * table go through qf_insert(), which wraps them around.
+ */
+struct qf_writer {
+	struct quotient_filter *qf;
+	uint64_t pos;		/* The cursor: the next slot to write. */
+	uint64_t quot;		/* The last fingerprint written. */
+	uint64_t rem;
+};
 
-void qf_destroy(struct quotient_filter *qf)
+static void writer_start(struct qf_writer *w, struct quotient_filter *qf)
 {
-	free(qf->qf_table);
+	w->qf = qf;
+	w->pos = 0;
+	w->quot = UINT64_MAX;
+	w->rem = 0;
 }
 
-void qfi_start(struct quotient_filter *qf, struct qf_iterator *i)
+static bool writer_add(struct qf_writer *w, uint64_t fq, uint64_t fr)
 {
-	/* Mark the iterator as done. */
-	i->qfi_visited = qf->qf_entries;
+	struct quotient_filter *qf = w->qf;
+	uint64_t entry = fr << 3;
 
-	if (qf->qf_entries == 0) {
-		return;
+	/* QF_EXPANDABLE tables keep each copy; see insert_entry(). */
+	if (fq == w->quot && fr == w->rem &&
+			!(qf->qf_flags & QF_EXPANDABLE)) {
+		return true;
+	}
+	if (w->pos >= qf->qf_nslots) {
+		w->quot = fq;
+		w->rem = fr;
+		return insert_entry(qf, fq, fr);
+	}
+	if (qf->qf_entries >= qf->qf_max_size) {
+		return false;
 	}
 
-	/* Find the start of a cluster. */
-	uint64_t start;
-	for (start = 0; start < qf->qf_max_size; ++start) {
-		if (is_cluster_start(get_elem(qf, start))) {
-			break;
-		}
+	if (fq == w->quot) {
+		entry = set_shifted(set_continuation(entry));
+	} else if (w->pos <= fq) {
+		w->pos = fq;
+		entry = set_occupied(entry);
+	} else {
+		set_elem(qf, fq, set_occupied(get_elem(qf, fq)));
+		entry = set_shifted(entry);
 	}
+	set_elem(qf, w->pos++, entry);
+	++qf->qf_entries;
+	w->quot = fq;
+	w->rem = fr;
+	return true;
+}
+
+/* The number of bits in the fingerprints of a QF. */
+static inline uint32_t fingerprint_bits(struct quotient_filter *qf)
+{
+	return qf->qf_qbits + qf->qf_rbits;
+}
+
+/* An input of merge_streams(), and the fingerprint it yields next. */
+struct merge_source {
+	struct quotient_filter *qf;
+	struct qf_iterator qfi;
+	uint64_t hash;
+};
+
+/*
+ * Restore the min-heap order of heap[0, n) by the sources' next hashes, or by
+ * the bits of them in mask.
+ */
+static void sift_down(struct merge_source **heap, size_t n, size_t i,
+		uint64_t mask)
+{
+	struct merge_source *top = heap[i];
+	while (2 * i + 1 < n) {
+		size_t c = 2 * i + 1;
+		if (c + 1 < n && (heap[c + 1]->hash & mask) <
+				(heap[c]->hash & mask)) {
+			++c;
+		}
+		if ((top->hash & mask) <= (heap[c]->hash & mask)) {
+			break;
+		}
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = top;
+}
+
+/*
+ * Merge the k filters in qfs into qfout, which is cleared first, when some
+ * have wider fingerprints than qfout. Their lowest q+r bits are no longer in
+ * order, so they are gathered and radix sorted by qf_bulk_build().
+ */
+static bool merge_truncated(struct quotient_filter *const *qfs, size_t k,
+		struct quotient_filter *qfout, uint32_t nthreads)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < k; ++i) {
+		n += qfs[i]->qf_entries;
+	}
+	uint64_t *hashes = (uint64_t *) malloc(MAX(n, 1) * sizeof(uint64_t));
+	if (!hashes) {
+		return false;
+	}
+
+	n = 0;
+	for (size_t i = 0; i < k; ++i) {
+		struct qf_iterator qfi;
+		qfi_start(qfs[i], &qfi);
+		while (!qfi_done(qfs[i], &qfi)) {
+			hashes[n++] = qfi_next(qfs[i], &qfi);
+		}
+	}
+	qf_clear(qfout);
+	bool ok = qf_bulk_build(qfout, hashes, n, nthreads);
+	free(hashes);
+	return ok;
+}
+
+/*
+ * Position i at the first run of qf with a quotient of at least quot, or
+ * return false if there is none. From there on, i is only good for as long
+ * as the fingerprints it returns keep ascending.
+ */
+static bool merge_seek(struct quotient_filter *qf, struct qf_iterator *i,
+		uint64_t quot)
+{
+	if (qf->qf_entries == 0 || quot > qf->qf_index_mask) {
+		return false;
+	}
+	if (!slot_occupied(qf, quot)) {
+		if (qf->qf_flags & QF_NOWRAP) {
+			/* next_occupied() would run off the end. */
+			do {
+				if (++quot > qf->qf_index_mask) {
+					return false;
+				}
+			} while (!slot_occupied(qf, quot));
+		} else {
+			uint64_t next = next_occupied(qf, quot);
+			if (next < quot) {
+				return false;
+			}
+			quot = next;
+		}
+	}
+
+	i->qfi_visited = 0;
+	i->qfi_index = find_run_index(qf, quot);
+	i->qfi_quotient = (quot - 1) & qf->qf_index_mask;
+	return true;
+}
+
+/*
+ * The slot at which an iterator of qf which did not start at its first run
+ * has to stop. One which wraps around turns back to lower fingerprints, but
+ * a QF_NOWRAP one would run off the table.
+ */
+static uint64_t iterator_end(struct quotient_filter *qf)
+{
+	uint64_t end = UINT64_MAX;
+	if (qf->qf_flags & QF_NOWRAP) {
+		end = qf->qf_nslots;
+		while (end > 0 && is_empty_element(get_elem(qf, end - 1))) {
+			--end;
+		}
+	}
+	return end;
+}
+
+/*
+ * Step src to its next fingerprint, unless it passes the end of the range,
+ * wraps around, or runs into slot end.
+ */
+static bool range_next(struct merge_source *src, uint64_t end, uint64_t last)
+{
+	struct quotient_filter *qf = src->qf;
+
+	if (qfi_done(qf, &src->qfi) || src->qfi.qfi_index >= end) {
+		return false;
+	}
+	uint64_t hash = qfi_next(qf, &src->qfi);
+	if (hash < src->hash || hash > last) {
+		return false;
+	}
+	src->hash = hash;
+	return true;
+}
+
+/*
+ * Merge the fingerprints of thread bt's buckets from the inputs of b, from
+ * bt->resume on and without duplicates. With a writer, they are laid out in
+ * the thread's own slots, up to the first slot of the next thread: the first
+ * fingerprint which would land there is left in bt->resume. Without one,
+ * they go through qf_insert(), which shifts whatever is in their way.
+ */
+static bool merge_range(struct bulk_build *b, struct bulk_thread *bt,
+		struct qf_writer *w)
+{
+	struct quotient_filter *qf = b->qf;
+	uint64_t first = bt->resume;
+	uint64_t last = ((uint64_t) bulk_bucket(b, bt->t + 1) << b->shift) - 1;
+	uint64_t limit = (uint64_t) bulk_bucket(b, bt->t + 1) <<
+		(b->shift - qf->qf_rbits);
+	struct merge_source *src = b->sources + (size_t) bt->t * b->k;
+	struct merge_source **heap = b->heaps + (size_t) bt->t * b->k;
+	size_t n = 0;
+
+	for (size_t i = 0; i < b->k; ++i) {
+		struct quotient_filter *in = b->qfs[i];
+		src[i].qf = in;
+		src[i].hash = 0;
+		if (!merge_seek(in, &src[i].qfi, first >> in->qf_rbits)) {
+			continue;
+		}
+		/* The first run may begin below the range. */
+		bool live;
+		do {
+			live = range_next(&src[i], b->ends[i], last);
+		} while (live && src[i].hash < first);
+		if (live) {
+			heap[n++] = &src[i];
+		}
+	}
+	for (size_t i = n / 2; i-- > 0; ) {
+		sift_down(heap, n, i, UINT64_MAX);
+	}
+
+	bool any = false;
+	uint64_t prev = 0;
+	while (n > 0) {
+		struct merge_source *top = heap[0];
+		if (!any || top->hash != prev) {
+			uint64_t fq = hash_to_quotient(qf, top->hash);
+			uint64_t fr = hash_to_remainder(qf, top->hash);
+			if (w) {
+				uint64_t pos = fq == w->quot ? w->pos :
+					MAX(w->pos, fq);
+				if (pos >= limit) {
+					bt->resume = top->hash;
+					bt->spilled = true;
+					return true;
+				}
+				if (!writer_add(w, fq, fr)) {
+					return false;
+				}
+			} else if (!insert_entry(qf, fq, fr)) {
+				return false;
+			}
+			prev = top->hash;
+			any = true;
+		}
+		if (!range_next(top, b->ends[top - src], last)) {
+			heap[0] = heap[--n];
+		}
+		sift_down(heap, n, 0, UINT64_MAX);
+	}
+	return true;
+}
+
+/*
+ * Lay out thread bt's fingerprints from the first slot of its buckets. Its
+ * writer counts them in a copy of qfout, as the threads share its table but
+ * not qf_entries.
+ */
+static void *merge_write(void *arg)
+{
+	struct bulk_thread *bt = (struct bulk_thread *) arg;
+	struct bulk_build *b = bt->b;
+	struct quotient_filter part = *b->qf;
+	struct qf_writer w;
+
+	part.qf_entries = 0;
+	writer_start(&w, &part);
+	w.pos = (uint64_t) bulk_bucket(b, bt->t) << (b->shift - part.qf_rbits);
+	bt->resume = (uint64_t) bulk_bucket(b, bt->t) << b->shift;
+	bt->spilled = false;
+	bt->ok = merge_range(b, bt, &w);
+	bt->count = part.qf_entries;
+	return NULL;
+}
+
+/*
+ * Merge the k filters in qfs into qfout, which is empty and as wide as each
+ * of them, on nthreads threads. Every thread merges the fingerprints of its
+ * own range of buckets straight into its own slots of qfout, which start on
+ * a word boundary, like bulk_layout() does. A run which would spill into the
+ * next thread's slots stops it; the rest of its range is then merged again
+ * from there and inserted, shifting the clusters in its way.
+ */
+static bool merge_parallel(struct quotient_filter *const *qfs, size_t k,
+		struct quotient_filter *qfout, uint32_t nthreads)
+{
+	struct bulk_build b;
+	bool ok = bulk_init(&b, qfout, NULL, 0, nthreads);
+	if (ok) {
+		b.qfs = qfs;
+		b.k = k;
+		b.sources = (struct merge_source *) malloc(
+				b.nthreads * k * sizeof(*b.sources));
+		b.heaps = (struct merge_source **) malloc(
+				b.nthreads * k * sizeof(*b.heaps));
+		b.ends = (uint64_t *) malloc(k * sizeof(uint64_t));
+		ok = b.sources && b.heaps && b.ends;
+	}
+	if (ok) {
+		/* Iterators which start mid-table cannot tell when done. */
+		for (size_t i = 0; i < k; ++i) {
+			b.ends[i] = iterator_end(qfs[i]);
+		}
+
+		bulk_run(&b, merge_write);
+		for (uint32_t t = 0; t < b.nthreads; ++t) {
+			ok &= b.threads[t].ok;
+			qfout->qf_entries += b.threads[t].count;
+		}
+		for (uint32_t t = 0; t < b.nthreads && ok; ++t) {
+			if (b.threads[t].spilled) {
+				ok = merge_range(&b, &b.threads[t], NULL);
+			}
+		}
+	}
+
+	free(b.sources);
+	free(b.heaps);
+	free(b.ends);
+	bulk_free(&b);
+	return ok;
+}
+
+/*
+ * Merge the k filters in qfs into qfout, which is cleared first, and must not
+ * have more q+r bits than any of them. None of them may hold anything but
+ * plain fingerprints, as QF_EXPANDABLE and QF_COUNTING tables do. Wider
+ * fingerprints keep their lowest bits, like the hashes they came from would
+ * in qf_insert(). When no input is wider, their ascending streams are merged
+ * by popping the smallest one off a heap of iterators, or by merge_parallel()
+ * on more than one thread.
+ */
+static bool merge_streams(struct quotient_filter *const *qfs, size_t k,
+		struct quotient_filter *qfout, uint32_t nthreads)
+{
+	struct merge_source local[16];
+	struct merge_source *heap_local[16];
+	struct merge_source *src = local;
+	struct merge_source **heap = heap_local;
+	uint32_t flags = qfout->qf_flags;
+	bool truncate = false;
+
+	for (size_t i = 0; i < k; ++i) {
+		qf_expand_finish(qfs[i]);
+		if (fingerprint_bits(qfout) > fingerprint_bits(qfs[i])) {
+			return false;
+		}
+		flags |= qfs[i]->qf_flags;
+		truncate |= fingerprint_bits(qfout) < fingerprint_bits(qfs[i]);
+	}
+	if (flags & (QF_EXPANDABLE | QF_COUNTING)) {
+		return false;
+	}
+	if (truncate) {
+		return merge_truncated(qfs, k, qfout, nthreads);
+	}
+	if (nthreads > 1) {
+		qf_clear(qfout);
+		if (!merge_parallel(qfs, k, qfout, nthreads)) {
+			qf_clear(qfout);
+			return false;
+		}
+		return true;
+	}
+	if (k > 16) {
+		src = (struct merge_source *) malloc(k * sizeof(*src));
+		heap = (struct merge_source **) malloc(k * sizeof(*heap));
+		if (!src || !heap) {
+			free(src);
+			free(heap);
+			return false;
+		}
+	}
+	qf_clear(qfout);
+
+	size_t n = 0;
+	for (size_t i = 0; i < k; ++i) {
+		src[i].qf = qfs[i];
+		qfi_start(qfs[i], &src[i].qfi);
+		if (!qfi_done(qfs[i], &src[i].qfi)) {
+			src[i].hash = qfi_next(qfs[i], &src[i].qfi);
+			heap[n++] = &src[i];
+		}
+	}
+	for (size_t i = n / 2; i-- > 0; ) {
+		sift_down(heap, n, i, UINT64_MAX);
+	}
+
+	struct qf_writer w;
+	bool ok = true;
+	writer_start(&w, qfout);
+	while (n > 0 && ok) {
+		struct merge_source *top = heap[0];
+		ok = writer_add(&w, hash_to_quotient(qfout, top->hash),
+				hash_to_remainder(qfout, top->hash));
+		if (qfi_done(top->qf, &top->qfi)) {
+			heap[0] = heap[--n];
+		} else {
+			top->hash = qfi_next(top->qf, &top->qfi);
+		}
+		sift_down(heap, n, 0, UINT64_MAX);
+	}
+
+	if (src != local) {
+		free(src);
+		free(heap);
+	}
+	if (!ok) {
+		qf_clear(qfout);
+	}
+	return ok;
+}
+
+bool qf_merge_into(struct quotient_filter *qf1, struct quotient_filter *qf2,
+		struct quotient_filter *qfout)
+{
+	struct quotient_filter *qfs[2] = {qf1, qf2};
+	return merge_streams(qfs, 2, qfout, 1);
+}
+
+/*
+ * Initializes qfout for the merge of the k filters in qfs. It keeps the q+r
+ * bits of the narrowest input, and gets the fewest quotient bits which hold
+ * the combined entries within QF_MERGE_MAX_LOAD.
+ */
+static bool merge_init(struct quotient_filter *const *qfs, size_t k,
+		struct quotient_filter *qfout)
+{
+	uint64_t entries = 0;
+	uint32_t bits = 64;
+	for (size_t i = 0; i < k; ++i) {
+		if (qfs[i]->qf_flags & (QF_EXPANDABLE | QF_COUNTING)) {
+			return false;
+		}
+		qf_expand_finish(qfs[i]);
+		entries += qfs[i]->qf_entries;
+		if (fingerprint_bits(qfs[i]) < bits) {
+			bits = fingerprint_bits(qfs[i]);
+		}
+	}
+
+	uint32_t q = 1;
+	while (q < bits - 1 &&
+			entries > QF_MERGE_MAX_LOAD * (double) (1ULL << q)) {
+		++q;
+	}
+	return qf_init_flags(qfout, q, bits - q, qfs[0]->qf_flags);
+}
+
+bool qf_merge(struct quotient_filter *qf1, struct quotient_filter *qf2,
+		struct quotient_filter *qfout)
+{
+	struct quotient_filter *qfs[2] = {qf1, qf2};
+	return qf_merge_many(qfs, 2, qfout);
+}
+
+bool qf_merge_many(struct quotient_filter *const *qfs, size_t k,
+		struct quotient_filter *qfout)
+{
+	if (k == 0 || !merge_init(qfs, k, qfout)) {
+		return false;
+	}
+
+	if (!merge_streams(qfs, k, qfout, 1)) {
+		qf_destroy(qfout);
+		return false;
+	}
+	return true;
+}
+
+bool qf_merge_parallel(struct quotient_filter *qf1,
+		struct quotient_filter *qf2, struct quotient_filter *qfout,
+		uint32_t nthreads)
+{
+	struct quotient_filter *qfs[2] = {qf1, qf2};
+	if (!merge_init(qfs, 2, qfout)) {
+		return false;
+	}
+
+	if (!merge_streams(qfs, 2, qfout, nthreads)) {
+		qf_destroy(qfout);
+		return false;
+	}
+	return true;
+}
+
+/* How many quotients qf_union_into() walks ahead before it searches. */
+#define UNION_WALK 16
+
+/*
+ * Return the slot where the run of fq starts, or would start, walking from
+ * slot s in the run of cq past the runs in between. fq must come after cq,
+ * and be marked occupied.
+ *
+ * The walk keeps its distance d from cq as it goes, rather than taking it
+ * from s: a run which spills past the end of the table can take s all the
+ * way around to cq, which would look like no distance at all.
+ */
+static uint64_t walk_to_run(struct quotient_filter *qf, uint64_t cq,
+		uint64_t s, uint64_t fq)
+{
+	uint64_t mask = (qf->qf_flags & QF_NOWRAP) ? UINT64_MAX :
+		qf->qf_index_mask;
+	uint64_t d = (s - cq) & mask;
+
+	do {
+		s = incr(qf, s);
+		++d;
+	} while (is_continuation(get_elem(qf, s)));
+
+	/* A run starts at its quotient, or right after the previous run. */
+	for (uint64_t quot = next_occupied(qf, cq); quot != fq;
+			quot = next_occupied(qf, quot)) {
+		if (((quot - cq) & mask) > d) {
+			s = quot;
+			d = (quot - cq) & mask;
+		}
+		do {
+			s = incr(qf, s);
+			++d;
+		} while (is_continuation(get_elem(qf, s)));
+	}
+	return ((fq - cq) & mask) > d ? fq : s;
+}
+
+bool qf_union_into(struct quotient_filter *dst, struct quotient_filter *src)
+{
+	qf_expand_finish(dst);
+	qf_expand_finish(src);
+	if (fingerprint_bits(src) < fingerprint_bits(dst) ||
+			((dst->qf_flags | src->qf_flags) &
+				(QF_EXPANDABLE | QF_COUNTING))) {
+		return false;
+	}
+
+	/* Remember which fingerprints were new, to take them back out. */
+	uint64_t *fresh = (uint64_t *) calloc(src->qf_entries / 64 + 1,
+			sizeof(uint64_t));
+	if (!fresh) {
+		return false;
+	}
+
+	uint64_t cq = UINT64_MAX, cr = 0, cs = 0;
+	struct qf_iterator qfi;
+	bool ok = true;
+	size_t i;
+
+	qfi_start(src, &qfi);
+	for (i = 0; !qfi_done(src, &qfi); ++i) {
+		uint64_t hash = qfi_next(src, &qfi);
+		uint64_t fq = hash_to_quotient(dst, hash);
+		uint64_t fr = hash_to_remainder(dst, hash);
+		uint64_t T_fq = get_elem(dst, fq);
+		uint64_t entry = fr << 3;
+		uint64_t s;
+
+		if (fq == cq && fr == cr) {
+			continue;
+		}
+		if (is_empty_element(T_fq)) {
+			if (dst->qf_entries >= dst->qf_max_size) {
+				ok = false;
+				break;
+			}
+			set_elem(dst, fq, set_occupied(entry));
+			s = fq;
+		} else {
+			bool had_run = is_occupied(T_fq);
+			uint64_t start = UINT64_MAX;
+			bool found = false;
+
+			if (!had_run) {
+				set_elem(dst, fq, set_occupied(T_fq));
+			}
+			if (had_run && fq == cq && fr > cr) {
+				/* Resume the scan past the last remainder. */
+				s = incr(dst, cs);
+				if (is_continuation(get_elem(dst, s))) {
+					s = scan_run(dst, s, fr, &found);
+				}
+			} else {
+				/*
+				 * Walk only to a nearby later quotient, and
+				 * while some slot is free: the runs of a full
+				 * table could lap back around to cq.
+				 */
+				bool walk = cq != UINT64_MAX && fq > cq &&
+					fq - cq < UNION_WALK &&
+					dst->qf_entries < dst->qf_nslots;
+				start = walk ? walk_to_run(dst, cq, cs, fq) :
+					find_run_index(dst, fq);
+				s = had_run ? scan_run(dst, start, fr, &found) :
+					start;
+			}
+
+			if (found) {
+				cq = fq;
+				cr = fr;
+				cs = s;
+				continue;
+			}
+			if (dst->qf_entries >= dst->qf_max_size ||
+					((dst->qf_flags & QF_NOWRAP) &&
+					 !is_empty_element(get_elem(dst,
+						 dst->qf_nslots - 1)))) {
+				if (!had_run) {
+					set_elem(dst, fq, T_fq);
+				}
+				ok = false;
+				break;
+			}
+
+			if (had_run && s == start) {
+				/* The old start-of-run is now a continuation. */
+				uint64_t head = get_elem(dst, s);
+				set_elem(dst, s, set_continuation(head));
+			} else if (had_run) {
+				entry = set_continuation(entry);
+			}
+			if (s != fq) {
+				entry = set_shifted(entry);
+			}
+			insert_into(dst, s, entry);
+		}
+
+		++dst->qf_entries;
+		fresh[i / 64] |= 1ULL << (i % 64);
+		cq = fq;
+		cr = fr;
+		cs = s;
+	}
+
+	if (!ok) {
+		uint64_t fmask = (dst->qf_index_mask << dst->qf_rbits) |
+			dst->qf_rmask;
+		qfi_start(src, &qfi);
+		for (size_t j = 0; j < i; ++j) {
+			uint64_t hash = qfi_next(src, &qfi);
+			if ((fresh[j / 64] >> (j % 64)) & 1) {
+				qf_remove(dst, hash & fmask);
+			}
+		}
+	}
+	free(fresh);
+	return ok;
+}
+
+bool qf_split(struct quotient_filter *qf, struct quotient_filter *lo,
+		struct quotient_filter *hi)
+{
+	qf_expand_finish(qf);
+	uint32_t q = qf->qf_qbits;
+	if (q < 2 || (qf->qf_flags & (QF_EXPANDABLE | QF_COUNTING)) ||
+			!qf_init_flags(lo, q - 1, qf->qf_rbits, qf->qf_flags)) {
+		return false;
+	}
+	if (!qf_init_flags(hi, q - 1, qf->qf_rbits, qf->qf_flags)) {
+		qf_destroy(lo);
+		return false;
+	}
+
+	/*
+	 * The fingerprints come out in order, so all of lo's come first.
+	 * Each half drops the top quotient bit, which its own quotients do
+	 * not have room for.
+	 */
+	uint64_t top = 1ULL << (q - 1 + qf->qf_rbits);
+	struct quotient_filter *out = lo;
+	struct qf_iterator qfi;
+	struct qf_writer w;
+	bool ok = true;
+
+	writer_start(&w, lo);
+	qfi_start(qf, &qfi);
+	while (ok && !qfi_done(qf, &qfi)) {
+		uint64_t hash = qfi_next(qf, &qfi);
+		if (out == lo && (hash & top)) {
+			out = hi;
+			writer_start(&w, hi);
+		}
+		ok = writer_add(&w, hash_to_quotient(out, hash),
+				hash_to_remainder(out, hash));
+	}
+
+	if (!ok) {
+		qf_destroy(lo);
+		qf_destroy(hi);
+	}
+	return ok;
+}
+
+/*
+ * Move qf to a new table with q quotient and r remainder bits, where q+r is
+ * unchanged: every fingerprint keeps its bits, and only where they are split
+ * moves. They stay in order, so the new table is written in one sequential
+ * pass, and the old one is freed. qf is left as it was on failure.
+ */
+static bool reshape(struct quotient_filter *qf, uint32_t q, uint32_t r)
+{
+	struct quotient_filter out;
+	if (!qf_init_flags(&out, q, r, qf->qf_flags)) {
+		return false;
+	}
+	keep_settings(&out, qf);
+
+	struct qf_iterator qfi;
+	struct qf_writer w;
+	bool ok = true;
+
+	writer_start(&w, &out);
+	qfi_start(qf, &qfi);
+	while (ok && !qfi_done(qf, &qfi)) {
+		uint64_t hash = qfi_next(qf, &qfi);
+		ok = writer_add(&w, hash_to_quotient(&out, hash),
+				hash_to_remainder(&out, hash));
+	}
+
+	if (!ok) {
+		qf_destroy(&out);
+		return false;
+	}
+	qf_destroy(qf);
+	*qf = out;
+	return true;
+}
+
+/*
+ * qf_expand() for a QF_EXPANDABLE qf. The entries which have a fingerprint
+ * bit to give up stay in order, and are written in one sequential pass over
+ * qf. The few with none left are then inserted into both new quotients.
+ */
+static bool expand_ages(struct quotient_filter *qf)
+{
+	struct quotient_filter out;
+	if (!qf_init_flags(&out, qf->qf_qbits + 1, qf->qf_rbits + 1,
+				qf->qf_flags)) {
+		return false;
+	}
+	keep_settings(&out, qf);
+
+	uint64_t empties = 0;
+	struct qf_iterator qfi;
+	struct qf_writer w;
+	bool ok = true;
+
+	writer_start(&w, &out);
+	qfi_start(qf, &qfi);
+	while (ok && !qfi_done(qf, &qfi)) {
+		uint64_t hash = qfi_next(qf, &qfi);
+		uint64_t quot = hash >> qf->qf_rbits;
+		uint64_t rem = hash & qf->qf_rmask;
+		if (age_empty(qf, rem)) {
+			++empties;
+		} else {
+			ok = writer_add(&w, age_move_quotient(qf, quot, rem),
+					age_move_remainder(qf, rem));
+		}
+	}
+
+	qfi_start(qf, &qfi);
+	while (ok && empties > 0 && !qfi_done(qf, &qfi)) {
+		uint64_t hash = qfi_next(qf, &qfi);
+		uint64_t rem = hash & qf->qf_rmask;
+		if (age_empty(qf, rem)) {
+			ok = age_move(&out, qf, hash >> qf->qf_rbits, rem);
+			--empties;
+		}
+	}
+
+	if (!ok) {
+		qf_destroy(&out);
+		return false;
+	}
+	qf_destroy(qf);
+	*qf = out;
+	return true;
+}
+
+bool qf_expand(struct quotient_filter *qf)
+{
+	qf_expand_finish(qf);
+	if (qf->qf_flags & QF_EXPANDABLE) {
+		return expand_ages(qf);
+	}
+	if (qf->qf_rbits < 2 || (qf->qf_flags & QF_COUNTING)) {
+		return false;
+	}
+	return reshape(qf, qf->qf_qbits + 1, qf->qf_rbits - 1);
+}
+
+bool qf_shrink(struct quotient_filter *qf)
+{
+	qf_expand_finish(qf);
+	if (qf->qf_qbits < 2 ||
+			(qf->qf_flags & (QF_EXPANDABLE | QF_COUNTING)) ||
+			qf->qf_entries > (1ULL << (qf->qf_qbits - 1))) {
+		return false;
+	}
+	return reshape(qf, qf->qf_qbits - 1, qf->qf_rbits + 1);
+}
+
+/*
+ * The most bits qf_truncate_remainders() drops by merging streams; it sorts
+ * the fingerprints for more.
+ */
+#define TRUNCATE_MERGE_BITS 6
+
+/*
+ * Write the fingerprints of qf, cut down to the q+r bits of out, into the
+ * empty out. Those which share their top d bits, which are cut off, form a
+ * contiguous stream that stays in order, so the 2^d streams are merged.
+ */
+static bool truncate_streams(struct quotient_filter *qf,
+		struct quotient_filter *out, uint32_t d)
+{
+	struct merge_source src[1 << TRUNCATE_MERGE_BITS];
+	struct merge_source *heap[1 << TRUNCATE_MERGE_BITS];
+	uint64_t span = 1ULL << fingerprint_bits(out);
+	uint64_t end = iterator_end(qf);
+	size_t n = 0;
+
+	for (uint64_t j = 0; j < (1ULL << d); ++j) {
+		uint64_t first = j * span;
+		src[j].qf = qf;
+		src[j].hash = 0;
+		if (!merge_seek(qf, &src[j].qfi, first >> qf->qf_rbits)) {
+			continue;
+		}
+		/* The first run may begin below the stream. */
+		bool live;
+		do {
+			live = range_next(&src[j], end, first + span - 1);
+		} while (live && src[j].hash < first);
+		if (live) {
+			heap[n++] = &src[j];
+		}
+	}
+	for (size_t i = n / 2; i-- > 0; ) {
+		sift_down(heap, n, i, span - 1);
+	}
+
+	struct qf_writer w;
+	bool ok = true;
+	writer_start(&w, out);
+	while (ok && n > 0) {
+		struct merge_source *top = heap[0];
+		uint64_t hash = top->hash & (span - 1);
+		uint64_t last = (top - src + 1) * span - 1;
+		ok = writer_add(&w, hash_to_quotient(out, hash),
+				hash_to_remainder(out, hash));
+		if (!range_next(top, end, last)) {
+			heap[0] = heap[--n];
+		}
+		sift_down(heap, n, 0, span - 1);
+	}
+	return ok;
+}
+
+bool qf_truncate_remainders(struct quotient_filter *qf, uint32_t new_r)
+{
+	qf_expand_finish(qf);
+	if (new_r == 0 || new_r > qf->qf_rbits ||
+			(qf->qf_flags & (QF_EXPANDABLE | QF_COUNTING))) {
+		return false;
+	}
+	if (new_r == qf->qf_rbits) {
+		return true;
+	}
+
+	struct quotient_filter out;
+	if (!qf_init_flags(&out, qf->qf_qbits, new_r, qf->qf_flags)) {
+		return false;
+	}
+	keep_settings(&out, qf);
+
+	uint32_t d = qf->qf_rbits - new_r;
+	bool ok;
+	if (d <= TRUNCATE_MERGE_BITS) {
+		ok = truncate_streams(qf, &out, d);
+	} else {
+		ok = merge_truncated(&qf, 1, &out, 1);
+	}
+
+	if (!ok) {
+		qf_destroy(&out);
+		return false;
+	}
+	qf_destroy(qf);
+	*qf = out;
+	return true;
+}
+
+void qf_clear(struct quotient_filter *qf)
+{
+	if (qf->qf_old) {
+		qf_destroy(qf->qf_old);
+		free(qf->qf_old);
+		qf->qf_old = NULL;
+		qf->qf_migrated = 0;
+	}
+	qf->qf_entries = 0;
+	memset(qf->qf_table, 0, table_bytes(qf));
+}
+
+size_t qf_table_size(uint32_t q, uint32_t r)
+{
+	return qf_table_size_flags(q, r, QF_DEFAULT_FLAGS);
+}
+
+size_t qf_table_size_flags(uint32_t q, uint32_t r, uint32_t flags)
+{
+	struct quotient_filter qf;
+	if (!init_shape(&qf, q, r, flags)) {
+		return 0;
+	}
+	if (flags & QF_MMAP_FLAGS) {
+		return mapping_bytes(&qf);
+	}
+	return table_bytes(&qf);
+}
+
+void qf_destroy(struct quotient_filter *qf)
+{
+	if (qf->qf_old) {
+		qf_destroy(qf->qf_old);
+		free(qf->qf_old);
+	}
+	if (qf->qf_flags & QF_MMAP_FLAGS) {
+		munmap(qf->qf_table, mapping_bytes(qf));
+	} else {
+		free(qf->qf_table);
+	}
+}
+
+void qfi_start(struct quotient_filter *qf, struct qf_iterator *i)
+{
+	qf_expand_finish(qf);
+
+	/* Mark the iterator as done. */
+	i->qfi_visited = qf->qf_entries;
+
+	if (qf->qf_entries == 0) {
+		return;
+	}
+
+	/*
+	 * Start at the run of the lowest quotient, which may sit in a cluster
+	 * that wraps around the end of the table. Runs are laid out in
+	 * quotient order from there on, so fingerprints come out ascending.
+	 */
+	uint64_t quot = slot_occupied(qf, 0) ? 0 : next_occupied(qf, 0);
 
 	i->qfi_visited = 0;
-	i->qfi_index = start;
+	i->qfi_index = find_run_index(qf, quot);
+	i->qfi_quotient = (quot - 1) & qf->qf_index_mask;
 }
 
 bool qfi_done(struct quotient_filter *qf, struct qf_iterator *i)
@@ -463,11 +1921,8 @@ uint64_t qfi_next(struct quotient_filter *qf, struct qf_iterator *i)
 			i->qfi_quotient = i->qfi_index;
 		} else {
 			if (is_run_start(elt)) {
-				uint64_t quot = i->qfi_quotient;
-				do {
-					quot = incr(qf, quot);
-				} while (!is_occupied(get_elem(qf, quot)));
-				i->qfi_quotient = quot;
+				i->qfi_quotient = next_occupied(qf,
+						i->qfi_quotient);
 			}
 		}
 
@@ -6,19 +6,156 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+/*
+ * Flags accepted by qf_init_flags().
+ *
+ * QF_BLOCKED: Group the table into 64-slot blocks. Each block stores the
+ * is_occupied, is_continuation and is_shifted bits of its slots in three
+ * 64-bit words, followed by the 64 packed remainders. Runs and clusters are
+ * then located with popcount/select on whole words instead of decoding one
+ * slot at a time. Blocks keep no offset of the runs which spill into them,
+ * so finding a run walks back a word at a time to the start of its cluster,
+ * and counts its way forward from there: O(cluster / 64) words rather than
+ * constant time. That is a word or two at moderate loads, more as the table
+ * fills up.
+ */
+#define QF_BLOCKED	(1U << 0)
+
+/*
+ * QF_PLANES: Keep the is_occupied, is_continuation and is_shifted bits in
+ * three dense bitmaps, and the remainders in a separate packed array. Cluster
+ * and run scans only touch the bitmaps, and a negative lookup which fails the
+ * is_occupied test reads a single bit. Incompatible with QF_BLOCKED.
+ */
+#define QF_PLANES	(1U << 1)
+
+/*
+ * QF_NOWRAP: Instead of letting clusters wrap around the end of the table,
+ * append a small overflow tail of ~10 * sqrt(2^q) slots past slot 2^q. Scans
+ * become plain increments. Inserts fail if the tail fills up. May be combined
+ * with QF_BLOCKED or QF_PLANES.
+ */
+#define QF_NOWRAP	(1U << 5)
+
+/*
+ * QF_EXPANDABLE: Let the filter keep doubling, InfiniFilter-style, until q+r
+ * reaches 64. The quotient is taken from the top q bits of the 64-bit hash,
+ * and each entry holds up to r-1 of the hash bits below it, followed by a
+ * unary length marker: a fingerprint of length l is stored as its bits, a one
+ * bit, then r-1-l zeros. qf_expand() moves the top fingerprint bit of each
+ * entry into the quotient and widens the slots by a bit, so that the entries
+ * inserted from then on get r-1 bit fingerprints again. The false positive
+ * rate stays about the same across expansions: each one doubles that of the
+ * older entries, which are outnumbered by the newer ones. Entries with no
+ * bits left match both halves of their quotient and are copied into each.
+ *
+ * Each qf_insert() adds an entry, even if an equal one is in the table
+ * already, so that qf_remove() of one of two hashes which share it leaves
+ * the other in the filter. A hash which is inserted twice must then be
+ * removed twice.
+ *
+ * Only qf_insert(), qf_may_contain(), qf_may_contain_batch(), qf_remove(),
+ * qf_expand(), qf_expand_begin(), qf_expand_finish(), qf_clear() and
+ * qf_destroy() may be used in this mode; the functions which load, merge or
+ * split tables return false. Requires r >= 2.
+ */
+#define QF_EXPANDABLE	(1U << 6)
+
+/*
+ * QF_COUNTING: Count repeated fingerprints instead of storing them once.
+ * Up to two copies of a remainder are kept as that many slots in its run,
+ * and more as the remainder, a variable-length counter of the copies in the
+ * slots after it, and the remainder again; see qf.c. A skewed stream which
+ * inserts a few hashes over and over thus takes a few slots per hash, and
+ * qf_remove() takes a single copy away, so that removing one of two hashes
+ * which share a fingerprint leaves the other in the filter. qf_entries
+ * counts the slots in use, counters included. A full QF still takes another
+ * copy of a fingerprint whose group needs no more slots for it.
+ *
+ * Only qf_insert(), qf_may_contain(), qf_may_contain_batch(), qf_count(),
+ * qf_remove(), qf_clear() and qf_destroy() may be used in this mode; the
+ * functions which resize a QF, or load, merge or split tables, return false.
+ * Requires r >= 2, and excludes QF_EXPANDABLE.
+ */
+#define QF_COUNTING	(1U << 7)
+
+/*
+ * Allocation flags, for large tables. They may be combined with a layout.
+ *
+ * QF_HUGEPAGES: mmap() the table on a 2MB boundary and ask for transparent
+ * huge pages with madvise(), to cut TLB misses on random lookups. This is a
+ * hint, and silently falls back to small pages if THP is disabled.
+ *
+ * QF_HUGETLB: mmap() the table from the explicit 2MB hugetlbfs pool. qf_init
+ * fails if the pool cannot satisfy the request.
+ *
+ * QF_PREFAULT: Touch every page of the table in qf_init, so that its page
+ * faults are paid up front rather than on the first inserts.
+ *
+ * qf_destroy() releases tables allocated with any of these flags.
+ */
+#define QF_HUGEPAGES	(1U << 2)
+#define QF_HUGETLB	(1U << 3)
+#define QF_PREFAULT	(1U << 4)
+
+/* The default qf_prefetch distance of qf_may_contain_batch(), in hashes. */
+#define QF_PREFETCH_DISTANCE 16
+
+/*
+ * How many entries of the old table qf_insert(), qf_may_contain() and
+ * qf_remove() each move while a filter expands, rounded up to a whole run,
+ * and how many empty quotients they step over at most; see
+ * qf_expand_begin().
+ */
+#define QF_MIGRATE_ENTRIES 2
+#define QF_MIGRATE_QUOTIENTS 64
+
+/*
+ * How qf_insert() grows a QF with a qf_max_load.
+ *
+ * QF_GROW_INCREMENTAL: With qf_expand_begin(), so that no one insert pays for
+ * copying the whole table: each insert moves QF_MIGRATE_ENTRIES old entries
+ * until the old table is drained, which takes at most half as many inserts as
+ * it held. Inserts cost about twice as much while the QF expands, but none of
+ * them stalls. This is the default. QF_NOWRAP filters, which cannot be
+ * expanded that way, grow at once instead.
+ *
+ * QF_GROW_AT_ONCE: With qf_expand(). The insert which grows the QF rewrites
+ * the whole table in one sequential pass, and stalls for as long as that
+ * takes, but the inserts around it stay cheap. Use it where the throughput
+ * of a batch of inserts matters more than the latency of each.
+ */
+#define QF_GROW_INCREMENTAL	0
+#define QF_GROW_AT_ONCE		1
+
+/* The highest load factor at which qf_merge() sizes its output. */
+#define QF_MERGE_MAX_LOAD 0.75
+
 struct quotient_filter {
 	uint8_t qf_qbits;
 	uint8_t qf_rbits;
 	uint8_t qf_elem_bits;
-	uint32_t qf_entries;
+	uint64_t qf_entries;
 	uint64_t qf_index_mask;
 	uint64_t qf_rmask;
 	uint64_t qf_elem_mask;
 	uint64_t qf_max_size;
+	uint64_t qf_nslots;
 	uint64_t *qf_table;
+	uint32_t qf_flags;
+	uint8_t qf_store;
+	uint32_t qf_prefetch;
+	struct quotient_filter *qf_old;	/* Still expanding out of this. */
+	uint64_t qf_migrated;	/* The old quotients moved so far. */
+	double qf_max_load;	/* Grow instead of passing this; 0: never. */
+	uint8_t qf_grow_policy;
+	uint32_t qf_grows;	/* How often qf_insert() has grown the QF. */
+	void (*qf_on_grow)(struct quotient_filter *qf, void *arg);
+	void *qf_grow_arg;
 };
 
 struct qf_iterator {
@@ -30,24 +167,96 @@ struct qf_iterator {
 /*
  * Initializes a quotient filter with capacity 2^q.
  * Increasing r improves the filter's accuracy but uses more space.
+ * With r = 5, 13 or 29, each slot is a whole 8, 16 or 32-bit integer, which
+ * makes table accesses cheaper.
  * 
  * Returns false if q == 0, r == 0, q+r > 64, or on ENOMEM.
  */
 bool qf_init(struct quotient_filter *qf, uint32_t q, uint32_t r);
 
+/*
+ * Like qf_init(), but selects a table layout (QF_BLOCKED, QF_PLANES,
+ * QF_NOWRAP), the way the table is allocated (QF_HUGEPAGES, QF_HUGETLB,
+ * QF_PREFAULT), and whether it is QF_EXPANDABLE or QF_COUNTING.
+ *
+ * Returns false if the flags are invalid, or for any reason qf_init() would.
+ */
+bool qf_init_flags(struct quotient_filter *qf, uint32_t q, uint32_t r,
+	uint32_t flags);
+
 /*
  * Inserts a hash into the QF.
  * Only the lowest q+r bits are actually inserted into the QF table.
  *
- * Returns false if the QF is full.
+ * If qf->qf_max_load is set, to 0.85 say, the QF grows before an insert would
+ * take qf_entries / qf_max_size past it, which keeps clusters short. It also
+ * grows rather than fail when a QF_NOWRAP tail fills up. It grows by its
+ * qf_grow_policy, counts each time in qf_grows, and then calls
+ * qf->qf_on_grow(qf, qf->qf_grow_arg) if that is set. qf_init leaves
+ * qf_max_load at 0, and the policy at QF_GROW_INCREMENTAL; these fields may
+ * be changed at any time. A QF which qf_expand() refuses fills up instead.
+ * While a QF grows incrementally, the caveats of qf_expand_begin() apply.
+ *
+ * Returns false if the QF is full, or if the overflow tail of a QF_NOWRAP QF
+ * has no room left, and it cannot grow.
  */
 bool qf_insert(struct quotient_filter *qf, uint64_t hash);
 
+/*
+ * Fills an empty QF with n hashes in one pass over the table, without the
+ * shifting of repeated qf_insert() calls. The hashes must be sorted by their
+ * lowest q+r bits, i.e by fingerprint; repeated fingerprints are loaded once.
+ * The table ends up exactly as if the hashes had been inserted one at a time.
+ *
+ * Returns false, leaving the QF untouched, if it is not empty, if the hashes
+ * are out of order, or if they would not fit, and for QF_EXPANDABLE or
+ * QF_COUNTING.
+ */
+bool qf_bulk_load(struct quotient_filter *qf, const uint64_t *hashes,
+	size_t n);
+
+/*
+ * Like qf_bulk_load(), but for hashes in any order. The fingerprints are radix
+ * sorted and laid out by up to nthreads threads, each on its own range of
+ * quotients. The hashes array is overwritten with the sorted fingerprints.
+ *
+ * Returns false on ENOMEM, if the QF is not empty, for QF_EXPANDABLE or
+ * QF_COUNTING, or if the hashes would not fit.
+ */
+bool qf_bulk_build(struct quotient_filter *qf, uint64_t *hashes, size_t n,
+	uint32_t nthreads);
+
 /*
  * Returns true if the QF may contain the hash. Returns false otherwise.
  */
 bool qf_may_contain(struct quotient_filter *qf, uint64_t hash);
 
+/*
+ * Looks up n hashes at once: bit i % 64 of out[i / 64] is set to
+ * qf_may_contain(qf, hashes[i]), and out must hold (n + 63) / 64 words.
+ *
+ * The hashes go through in chunks of 64, in stages: the canonical slots of a
+ * chunk are computed first, then their `is_occupied' bits are tested, with
+ * the slots qf->qf_prefetch positions ahead prefetched, and only then are the
+ * runs of the occupied ones scanned. The cache misses of a chunk thus overlap
+ * instead of stalling one lookup at a time. qf_init sets qf_prefetch to
+ * QF_PREFETCH_DISTANCE; it may be changed at any time, up to 64, and 0 turns
+ * prefetching off.
+ *
+ * While qf expands, the batch moves it along by one step, as one call to
+ * qf_may_contain() would.
+ */
+void qf_may_contain_batch(struct quotient_filter *qf, const uint64_t *hashes,
+	size_t n, uint64_t *out);
+
+/*
+ * Returns how many times the hash's fingerprint was inserted into a
+ * QF_COUNTING QF and not removed since: an upper bound on the copies of the
+ * hash itself. Any other QF counts a fingerprint once, so this returns 1 if
+ * it may contain the hash, and 0 otherwise.
+ */
+uint64_t qf_count(struct quotient_filter *qf, uint64_t hash);
+
 /*
  * Removes a hash from the QF.
  *
@@ -59,32 +268,216 @@ bool qf_may_contain(struct quotient_filter *qf, uint64_t hash);
  *	remove(qf, A:X)   # X is removed from the table.
  *
  * Now, may-contain(qf, B:X) == false, which is a ruinous false negative.
+ * A QF_COUNTING QF keeps both copies of X instead, so that the third call
+ * leaves one behind. Removes are then safe for hashes of any width, as long
+ * as each hash removed was inserted.
  *
- * Returns false if the hash uses more than q+r bits.
+ * A QF_EXPANDABLE QF keeps an entry for each insert of X as well, and
+ * removes the longest of the entries that match the hash: the hashes which
+ * matched it also match any shorter one left behind. It is just as safe, as
+ * long as each hash removed was inserted.
+ *
+ * Returns false if the hash uses more than q+r bits, unless the QF is
+ * QF_COUNTING or QF_EXPANDABLE: these take hashes of any width.
  */
 bool qf_remove(struct quotient_filter *qf, uint64_t hash);
 
 /*
  * Initializes qfout and copies over all elements from qf1 and qf2.
- * Caution: qfout holds twice as many entries as either qf1 or qf2.
+ * qfout uses the same layout and allocation flags as qf1.
+ *
+ * qfout gets the q+r bits of the narrower input, and just enough quotient
+ * bits to hold qf1->qf_entries + qf2->qf_entries at a load factor of at most
+ * QF_MERGE_MAX_LOAD. The fingerprints of a wider input are cut down to their
+ * lowest q+r bits, as qf_insert() would cut down the hashes they came from.
+ * Hashes which were inserted into qf1 or qf2 are thus found in qfout, with a
+ * false positive rate no lower than the narrower input's.
  *
- * Returns false on ENOMEM.
+ * Returns false if an input is QF_EXPANDABLE or QF_COUNTING, on ENOMEM, or if
+ * qfout runs out of room: this happens when the union does not fit in
+ * 2^(q+r-1) slots, or fills a QF_NOWRAP tail.
  */
 bool qf_merge(struct quotient_filter *qf1, struct quotient_filter *qf2,
 	struct quotient_filter *qfout);
 
 /*
- * Resets the QF table. This function does not deallocate any memory.
+ * Like qf_merge(), but into a qfout which is already initialized, so that its
+ * table can be reused. Whatever qfout held is cleared first. The fingerprints
+ * of qf1 and qf2 are merged as two sorted streams, and qfout is written in a
+ * single sequential pass. If qfout has fewer q+r bits than an input, the
+ * fingerprints are cut down and radix sorted instead.
+ *
+ * Returns false, leaving qfout untouched, if it has more q+r bits than qf1 or
+ * qf2, or if any of the three is QF_EXPANDABLE or QF_COUNTING. Returns false
+ * on ENOMEM, or if qfout cannot hold the union, and qfout is then left empty.
+ */
+bool qf_merge_into(struct quotient_filter *qf1, struct quotient_filter *qf2,
+	struct quotient_filter *qfout);
+
+/*
+ * Initializes qfout and merges all elements of the k filters in qfs into it,
+ * in a single pass over a heap of their iterators. qfout uses the same layout
+ * and allocation flags as qfs[0], and is sized like the output of qf_merge():
+ * the q+r bits of the narrowest input, and enough quotient bits for the
+ * combined qf_entries.
+ *
+ * Returns false if k == 0, or for any reason qf_merge() would.
+ */
+bool qf_merge_many(struct quotient_filter *const *qfs, size_t k,
+	struct quotient_filter *qfout);
+
+/*
+ * Like qf_merge(), but on up to nthreads threads. The fingerprint space is
+ * split into a range per thread, which merges its slice of qf1 and qf2 and
+ * lays it out in its own part of qfout's table as it goes, without staging
+ * them. The runs which would spill from one part into the next are inserted
+ * afterwards, with qf_insert()'s cost for each of their fingerprints.
+ *
+ * Returns false for any reason qf_merge() would.
+ */
+bool qf_merge_parallel(struct quotient_filter *qf1,
+	struct quotient_filter *qf2, struct quotient_filter *qfout,
+	uint32_t nthreads);
+
+/*
+ * Inserts every element of src into dst, in place. src's fingerprints are
+ * inserted in ascending order, and each one's insert position is found by
+ * walking on from the previous one's, instead of searching from the start of
+ * its cluster. The fingerprints of a wider src are cut down to dst's q+r
+ * bits, as in qf_merge().
+ *
+ * Returns false if src has fewer q+r bits than dst, if either is
+ * QF_EXPANDABLE or QF_COUNTING, on ENOMEM, or if dst runs out of room. dst is
+ * then left as it was.
+ */
+bool qf_union_into(struct quotient_filter *dst, struct quotient_filter *src);
+
+/*
+ * Splits qf in two by the top bit of its quotients, the inverse of a merge.
+ * Initializes lo and hi with q-1 quotient bits and qf's remainder bits and
+ * flags, and copies the fingerprints whose top quotient bit is clear into lo,
+ * the rest into hi, without that bit. Both are written in one sequential pass
+ * over qf, which is left as it was.
+ *
+ * A hash then belongs to hi if bit q+r-1 of it is set. Lookups may pass it on
+ * as it is, but qf_remove() needs it cut down to the lowest q+r-1 bits.
+ *
+ * Returns false if q < 2, for QF_EXPANDABLE or QF_COUNTING, on ENOMEM, or if
+ * either half overflows, as it can when more than 2^(q-1) fingerprints share
+ * a top bit.
+ */
+bool qf_split(struct quotient_filter *qf, struct quotient_filter *lo,
+	struct quotient_filter *hi);
+
+/*
+ * Doubles the slots of qf, and its capacity, by moving the top remainder bit
+ * into the quotient: qf becomes a (q+1, r-1) filter with the same (q+r)-bit
+ * fingerprints, so the hashes that were inserted are still found, and it
+ * needs none of them. The new table is filled in one sequential pass over
+ * the old one, which is then freed.
+ *
+ * Each remainder bit that is given up doubles the false positive rate at a
+ * given load factor.
+ *
+ * An expansion started by qf_expand_begin() is finished first.
+ *
+ * A QF_EXPANDABLE qf becomes a (q+1, r+1) filter instead; see there.
+ *
+ * Returns false if r < 2, for QF_COUNTING, on ENOMEM, or if a QF_EXPANDABLE
+ * qf has q+r > 62. qf is then left as it was.
+ */
+bool qf_expand(struct quotient_filter *qf);
+
+/*
+ * Starts an incremental qf_expand(): qf gets its new (q+1, r-1) table at once,
+ * but keeps the old one in qf->qf_old, and moves its runs over a few entries
+ * at a time, QF_MIGRATE_ENTRIES on every call to qf_insert(),
+ * qf_may_contain() or qf_remove(). No one call copies the whole table.
+ *
+ * Until the old table is drained and freed, new hashes go into the new table,
+ * and a hash whose old quotient has not been moved yet is looked up in both.
+ * qf_entries counts the entries of both. The functions which work on the
+ * whole table, such as qfi_start(), the bulk loads, merges and qf_split(),
+ * call qf_expand_finish() to move what is left first. qf_clear() and
+ * qf_destroy() drop the old table too.
+ *
+ * A QF_EXPANDABLE qf gets a (q+1, r+1) table instead, and each old entry is
+ * moved into one or both of the quotients it splits into, as by qf_expand().
+ * Until then, qf_insert() keeps a slot spare for each old entry, and so
+ * fails once qf_entries plus qf->qf_old->qf_entries reaches qf_max_size.
+ *
+ * Returns false if qf is already expanding, if r < 2, for QF_COUNTING, for
+ * QF_NOWRAP, whose tail could fill up with a run half moved, or on ENOMEM. qf
+ * is then left as it was.
+ */
+bool qf_expand_begin(struct quotient_filter *qf);
+
+/*
+ * Moves whatever is left of an expansion started by qf_expand_begin(), and
+ * frees the old table. Does nothing if qf is not expanding.
+ */
+void qf_expand_finish(struct quotient_filter *qf);
+
+/*
+ * Halves the slots of qf, the inverse of qf_expand(): the low quotient bit
+ * moves into the remainder, and qf becomes a (q-1, r+1) filter with the same
+ * fingerprints. The new table is written in one sequential pass over the old
+ * one, which is then freed, so that a filter emptied out by qf_remove() gives
+ * its memory back.
+ *
+ * An expansion started by qf_expand_begin() is finished first.
+ *
+ * Returns false if q < 2, for QF_EXPANDABLE or QF_COUNTING, on ENOMEM, or if
+ * the entries do not fit in 2^(q-1) slots, or in a QF_NOWRAP tail. qf is then
+ * left as it was.
+ */
+bool qf_shrink(struct quotient_filter *qf);
+
+/*
+ * Trades accuracy for memory: rewrites qf with new_r bit remainders, and
+ * frees the old table. Each fingerprint is cut down to its lowest q+new_r
+ * bits, as qf_insert() would cut down the hash it came from, so the hashes
+ * that were inserted are still found. Fingerprints which become equal are
+ * kept once. Each bit that is dropped doubles the false positive rate.
+ *
+ * The top r-new_r bits of each quotient are dropped, and as many remainder
+ * bits move up into it, so the fingerprints change order. Those which shared
+ * the dropped bits stay in order, though, and up to 64 such streams are
+ * merged while the new table is written, in one pass. Beyond that, they are
+ * radix sorted in a buffer of qf_entries hashes first.
+ *
+ * An expansion started by qf_expand_begin() is finished first.
+ *
+ * Returns false if new_r is 0 or greater than r, for QF_EXPANDABLE or
+ * QF_COUNTING, on ENOMEM, or if a QF_NOWRAP tail overflows. qf is then left
+ * as it was.
+ */
+bool qf_truncate_remainders(struct quotient_filter *qf, uint32_t new_r);
+
+/*
+ * Resets the QF table. This function does not deallocate any memory, other
+ * than the old table of an expansion.
  */
 void qf_clear(struct quotient_filter *qf);
 
 /*
- * Finds the size (in bytes) of a QF table.
+ * Finds the size (in bytes) of the table qf_init(qf, q, r) allocates. Tables
+ * are allocated in whole 64-bit words.
  *
  * Caution: sizeof(struct quotient_filter) is not included.
+ *
+ * Returns 0 for any q and r qf_init() would refuse.
  */
 size_t qf_table_size(uint32_t q, uint32_t r);
 
+/*
+ * Like qf_table_size(), but for the table qf_init_flags(qf, q, r, flags)
+ * allocates: QF_BLOCKED tables round the slot count up to a multiple of 64,
+ * QF_PLANES tables also round each bitmap, QF_NOWRAP tables include their
+ * overflow tail, and mmap()ed tables are rounded up to whole huge pages.
+ */
+size_t qf_table_size_flags(uint32_t q, uint32_t r, uint32_t flags);
+
 /*
  * Deallocates the QF table.
  */
@@ -101,7 +494,8 @@ void qfi_start(struct quotient_filter *qf, struct qf_iterator *i);
 bool qfi_done(struct quotient_filter *qf, struct qf_iterator *i);
 
 /*
- * Returns the next (q+r)-bit fingerprint in the QF.
+ * Returns the next (q+r)-bit fingerprint in the QF. Fingerprints are returned
+ * in ascending order.
  *
  * Caution: Do not call this routine if qfi_done() == true.
  */
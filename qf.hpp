@@ -0,0 +1,147 @@
+/*
+ * qf.hpp
+ *
+ * Copyright (c) 2014 Vedant Kumar <vsk@berkeley.edu>
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+extern "C" {
+#include "qf.h"
+}
+
+/* Keep the helper macros of qf_core.h out of the files which include this. */
+#pragma push_macro("MAX")
+#pragma push_macro("MIN")
+#pragma push_macro("LOW_MASK")
+#pragma push_macro("ALWAYS_INLINE")
+#pragma push_macro("QF_X86_64")
+#pragma push_macro("TARGET_BMI2")
+#pragma push_macro("TARGET_AVX2")
+#pragma push_macro("SLIDE_UP")
+#pragma push_macro("SLIDE_DOWN")
+#pragma push_macro("COUNT_MAX_SLOTS")
+
+namespace qf_core {
+
+#define QF_SHAPED
+#include "qf_core.h"
+#undef QF_SHAPED
+
+/*
+ * The fields of a struct quotient_filter which qf_core.h reads, for a table
+ * initialized with qf_init_flags(qf, Q, R, 0). Only the entry count and the
+ * table vary.
+ */
+template <uint32_t Q, uint32_t R>
+struct shape {
+	static constexpr uint8_t qf_qbits = Q;
+	static constexpr uint8_t qf_rbits = R;
+	static constexpr uint8_t qf_elem_bits = R + 3;
+	static constexpr uint64_t qf_index_mask = LOW_MASK(Q);
+	static constexpr uint64_t qf_rmask = LOW_MASK(R);
+	static constexpr uint64_t qf_elem_mask = LOW_MASK(R + 3);
+	static constexpr uint64_t qf_max_size = 1ULL << Q;
+	static constexpr uint64_t qf_nslots = 1ULL << Q;
+	static constexpr uint32_t qf_flags = 0;
+	static constexpr uint8_t qf_store = R + 3 == 8 ? STORE_8 :
+		R + 3 == 16 ? STORE_16 : R + 3 == 32 ? STORE_32 : STORE_PACKED;
+
+	uint64_t qf_entries;
+	uint64_t *qf_table;
+};
+
+}
+
+#pragma pop_macro("MAX")
+#pragma pop_macro("MIN")
+#pragma pop_macro("LOW_MASK")
+#pragma pop_macro("ALWAYS_INLINE")
+#pragma pop_macro("QF_X86_64")
+#pragma pop_macro("TARGET_BMI2")
+#pragma pop_macro("TARGET_AVX2")
+#pragma pop_macro("SLIDE_UP")
+#pragma pop_macro("SLIDE_DOWN")
+#pragma pop_macro("COUNT_MAX_SLOTS")
+
+/*
+ * A quotient filter whose shape is fixed at compile time.
+ *
+ * It runs the same code as qf.c, from qf_core.h, on a table which is
+ * byte-for-byte identical to that of a struct quotient_filter initialized
+ * with qf_init_flags(qf, Q, R, 0). Every mask and shift is a compile-time
+ * constant, so the slot arithmetic folds away, and the checks for the other
+ * layouts and modes are dropped.
+ */
+template <uint32_t Q, uint32_t R>
+class QuotientFilter {
+	/* Slots are narrower than 64 bits, so elem_mask is a plain shift. */
+	static_assert(Q > 0 && R > 0 && Q + R <= 64 && R + 3 < 64,
+		"invalid q and r");
+
+	typedef qf_core::shape<Q, R> shape;
+
+public:
+	static constexpr uint32_t qbits = Q;
+	static constexpr uint32_t rbits = R;
+	static constexpr uint32_t elem_bits = shape::qf_elem_bits;
+	static constexpr uint64_t index_mask = shape::qf_index_mask;
+	static constexpr uint64_t rmask = shape::qf_rmask;
+	static constexpr uint64_t elem_mask = shape::qf_elem_mask;
+	static constexpr uint64_t max_size = shape::qf_max_size;
+	static constexpr size_t table_words = (max_size * elem_bits + 63) / 64;
+
+	QuotientFilter()
+	{
+		qf_.qf_entries = 0;
+		/*
+		 * A spare word keeps the spill branch of get_bits() and
+		 * set_bits() within bounds, as far as the compiler can tell.
+		 */
+		qf_.qf_table = static_cast<uint64_t *>(
+			calloc(table_words + 1, 8));
+		if (!qf_.qf_table) {
+			throw std::bad_alloc();
+		}
+	}
+
+	~QuotientFilter() { free(qf_.qf_table); }
+
+	/* See qf_insert(). Returns false if the QF is full. */
+	bool insert(uint64_t hash) { return qf_core::insert_hash(&qf_, hash); }
+
+	/* See qf_may_contain(). */
+	bool may_contain(uint64_t hash) const
+	{
+		return qf_core::lookup_hash(const_cast<shape *>(&qf_), hash);
+	}
+
+	/* See qf_remove() for the caveats. */
+	bool remove(uint64_t hash) { return qf_core::remove_hash(&qf_, hash); }
+
+	void clear()
+	{
+		qf_.qf_entries = 0;
+		memset(qf_.qf_table, 0, table_words * sizeof(uint64_t));
+	}
+
+	uint64_t entries() const { return qf_.qf_entries; }
+
+	/* The raw table, in the same format as quotient_filter::qf_table. */
+	const uint64_t *table() const { return qf_.qf_table; }
+
+private:
+	shape qf_;
+
+	QuotientFilter(const QuotientFilter &);
+	QuotientFilter &operator=(const QuotientFilter &);
+};
@@ -0,0 +1,1663 @@
+/*
+ * qf_core.h
+ *
+ * Copyright (c) 2014 Vedant Kumar <vsk@berkeley.edu>
+ */
+
+/*
+ * The slot, run and cluster algorithms behind qf.c, shared with the
+ * QuotientFilter<Q, R> template in qf.hpp.
+ *
+ * Each routine reads the shape of its table (r, the masks, the flags and the
+ * slot layout) through `qf'. qf.c includes this with QF standing for struct
+ * quotient_filter, whose shape is only known at run time. qf.hpp includes it
+ * inside a namespace with QF_SHAPED defined, which turns every routine that
+ * takes a QF into a template over a struct with the same fields, declared
+ * static constexpr. The compiler then folds the masks and shifts, and drops
+ * the layout and mode branches which do not apply.
+ *
+ * There is no include guard, since one file may include both. The includer
+ * provides <stdint.h>, <string.h>, qf.h and, on x86-64, <immintrin.h>.
+ */
+
+#ifdef QF_SHAPED
+#define QF_TEMPLATE template <class QF>
+#define QF_SHARED inline	/* One copy in the whole program. */
+#else
+#define QF_TEMPLATE
+#define QF_SHARED static
+typedef struct quotient_filter QF;
+#endif
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define LOW_MASK(n) ((1ULL << (n)) - 1ULL)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define QF_X86_64 1
+#define TARGET_BMI2 __attribute__((target("popcnt,lzcnt,bmi,bmi2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+/*
+ * Kinds of metadata words: their index within a QF_BLOCKED block, or their
+ * plane in a QF_PLANES table. Bit i of a word belongs to slot 64 * w + i.
+ */
+enum {
+	OCCUPIEDS,
+	CONTINUATIONS,
+	SHIFTEDS,
+	REMAINDERS,
+};
+
+/* Slot accessors, selected by qf_init_flags() from the layout and r. */
+enum {
+	STORE_PACKED,	/* (r+3)-bit slots, which may straddle two words. */
+	STORE_8,	/* r == 5: one uint8_t per slot. */
+	STORE_16,	/* r == 13: one uint16_t per slot. */
+	STORE_32,	/* r == 29: one uint32_t per slot. */
+	STORE_BLOCKED,	/* QF_BLOCKED. */
+	STORE_PLANES,	/* QF_PLANES. */
+};
+
+/*
+ * The number of allocated slots. A QF_NOWRAP table has an overflow tail past
+ * slot 2^q, plus one sentinel slot which is always empty, so that scans can
+ * step past the last slot without bounds checks.
+ */
+QF_TEMPLATE static inline uint64_t table_slots(QF *qf)
+{
+	return qf->qf_nslots + ((qf->qf_flags & QF_NOWRAP) ? 1 : 0);
+}
+
+QF_TEMPLATE static inline uint64_t nblocks(QF *qf)
+{
+	return (table_slots(qf) + 63) / 64;
+}
+
+QF_TEMPLATE static size_t table_bytes(QF *qf)
+{
+	uint64_t nslots = table_slots(qf);
+	if (qf->qf_store == STORE_PLANES) {
+		/* Three metadata bitmaps, then the r-bit remainders. */
+		uint64_t rwords = (nslots * qf->qf_rbits + 63) / 64;
+		return (3 * nblocks(qf) + rwords) * sizeof(uint64_t);
+	}
+	if (qf->qf_store == STORE_BLOCKED) {
+		return nblocks(qf) * qf->qf_elem_bits * sizeof(uint64_t);
+	}
+	return (nslots * qf->qf_elem_bits + 63) / 64 * sizeof(uint64_t);
+}
+
+/* Return the `nbits'-wide field at bit offset `bitpos' of `words'. */
+static inline uint64_t get_bits(const uint64_t *words, size_t bitpos,
+		int nbits, uint64_t mask)
+{
+	size_t tabpos = bitpos / 64;
+	size_t slotpos = bitpos % 64;
+	int spillbits = (slotpos + nbits) - 64;
+	uint64_t x = (words[tabpos] >> slotpos) & mask;
+	if (spillbits > 0) {
+		++tabpos;
+		uint64_t y = words[tabpos] & LOW_MASK(spillbits);
+		x |= y << (nbits - spillbits);
+	}
+	return x;
+}
+
+/* Store the lower bits of x into the field at bit offset `bitpos'. */
+static inline void set_bits(uint64_t *words, size_t bitpos, int nbits,
+		uint64_t mask, uint64_t x)
+{
+	size_t tabpos = bitpos / 64;
+	size_t slotpos = bitpos % 64;
+	int spillbits = (slotpos + nbits) - 64;
+	x &= mask;
+	words[tabpos] &= ~(mask << slotpos);
+	words[tabpos] |= x << slotpos;
+	if (spillbits > 0) {
+		++tabpos;
+		words[tabpos] &= ~LOW_MASK(spillbits);
+		words[tabpos] |= x >> (nbits - spillbits);
+	}
+}
+
+/*
+ * A QF_BLOCKED block holds 64 slots in (r + 3) words: one word each for the
+ * three metadata bits, then the 64 packed remainders.
+ */
+QF_TEMPLATE static inline uint64_t *get_block(QF *qf, uint64_t idx)
+{
+	return qf->qf_table + (idx / 64) * qf->qf_elem_bits;
+}
+
+QF_TEMPLATE static uint64_t get_block_elem(QF *qf, uint64_t idx)
+{
+	const uint64_t *block = get_block(qf, idx);
+	int bit = idx % 64;
+	uint64_t elt = (block[OCCUPIEDS] >> bit) & 1;
+	elt |= ((block[CONTINUATIONS] >> bit) & 1) << 1;
+	elt |= ((block[SHIFTEDS] >> bit) & 1) << 2;
+	elt |= get_bits(block + REMAINDERS, bit * qf->qf_rbits,
+			qf->qf_rbits, qf->qf_rmask) << 3;
+	return elt;
+}
+
+QF_TEMPLATE static void set_block_elem(QF *qf, uint64_t idx, uint64_t elt)
+{
+	uint64_t *block = get_block(qf, idx);
+	int bit = idx % 64;
+	uint64_t m = 1ULL << bit;
+	block[OCCUPIEDS] &= ~m;
+	block[OCCUPIEDS] |= (elt & 1) << bit;
+	block[CONTINUATIONS] &= ~m;
+	block[CONTINUATIONS] |= ((elt >> 1) & 1) << bit;
+	block[SHIFTEDS] &= ~m;
+	block[SHIFTEDS] |= ((elt >> 2) & 1) << bit;
+	set_bits(block + REMAINDERS, bit * qf->qf_rbits, qf->qf_rbits,
+			qf->qf_rmask, elt >> 3);
+}
+
+/*
+ * A QF_PLANES table holds one bitmap per metadata bit, each nblocks words
+ * long, followed by the packed r-bit remainders.
+ */
+QF_TEMPLATE static uint64_t get_plane_elem(QF *qf, uint64_t idx)
+{
+	const uint64_t *plane = qf->qf_table + idx / 64;
+	uint64_t stride = nblocks(qf);
+	int bit = idx % 64;
+	uint64_t elt = (plane[OCCUPIEDS * stride] >> bit) & 1;
+	elt |= ((plane[CONTINUATIONS * stride] >> bit) & 1) << 1;
+	elt |= ((plane[SHIFTEDS * stride] >> bit) & 1) << 2;
+	elt |= get_bits(qf->qf_table + REMAINDERS * stride, idx * qf->qf_rbits,
+			qf->qf_rbits, qf->qf_rmask) << 3;
+	return elt;
+}
+
+QF_TEMPLATE static void set_plane_elem(QF *qf, uint64_t idx, uint64_t elt)
+{
+	uint64_t *plane = qf->qf_table + idx / 64;
+	uint64_t stride = nblocks(qf);
+	int bit = idx % 64;
+	uint64_t m = 1ULL << bit;
+	plane[OCCUPIEDS * stride] &= ~m;
+	plane[OCCUPIEDS * stride] |= (elt & 1) << bit;
+	plane[CONTINUATIONS * stride] &= ~m;
+	plane[CONTINUATIONS * stride] |= ((elt >> 1) & 1) << bit;
+	plane[SHIFTEDS * stride] &= ~m;
+	plane[SHIFTEDS * stride] |= ((elt >> 2) & 1) << bit;
+	set_bits(qf->qf_table + REMAINDERS * stride, idx * qf->qf_rbits,
+			qf->qf_rbits, qf->qf_rmask, elt >> 3);
+}
+
+/*
+ * Return QF[idx] in the lower bits.
+ *
+ * When r+3 is 8, 16 or 32, slots are whole aligned integers and never spill
+ * into the next word, so they are accessed with plain loads and stores.
+ */
+QF_TEMPLATE static inline uint64_t get_elem(QF *qf, uint64_t idx)
+{
+	switch (qf->qf_store) {
+	case STORE_8:
+		return ((const uint8_t *) qf->qf_table)[idx];
+	case STORE_16:
+		return ((const uint16_t *) qf->qf_table)[idx];
+	case STORE_32:
+		return ((const uint32_t *) qf->qf_table)[idx];
+	case STORE_BLOCKED:
+		return get_block_elem(qf, idx);
+	case STORE_PLANES:
+		return get_plane_elem(qf, idx);
+	default:
+		return get_bits(qf->qf_table, qf->qf_elem_bits * idx,
+				qf->qf_elem_bits, qf->qf_elem_mask);
+	}
+}
+
+/* Store the lower bits of elt into QF[idx]. */
+QF_TEMPLATE static inline void set_elem(QF *qf, uint64_t idx, uint64_t elt)
+{
+	switch (qf->qf_store) {
+	case STORE_8:
+		((uint8_t *) qf->qf_table)[idx] = (uint8_t) elt;
+		break;
+	case STORE_16:
+		((uint16_t *) qf->qf_table)[idx] = (uint16_t) elt;
+		break;
+	case STORE_32:
+		((uint32_t *) qf->qf_table)[idx] = (uint32_t) elt;
+		break;
+	case STORE_BLOCKED:
+		set_block_elem(qf, idx, elt);
+		break;
+	case STORE_PLANES:
+		set_plane_elem(qf, idx, elt);
+		break;
+	default:
+		set_bits(qf->qf_table, qf->qf_elem_bits * idx,
+				qf->qf_elem_bits, qf->qf_elem_mask, elt);
+		break;
+	}
+}
+
+/* Clusters wrap around the end of the table, unless it is QF_NOWRAP. */
+QF_TEMPLATE static inline uint64_t incr(QF *qf, uint64_t idx)
+{
+	if (qf->qf_flags & QF_NOWRAP) {
+		return idx + 1;
+	}
+	return (idx + 1) & qf->qf_index_mask;
+}
+
+QF_TEMPLATE static inline uint64_t decr(QF *qf, uint64_t idx)
+{
+	if (qf->qf_flags & QF_NOWRAP) {
+		return idx - 1;
+	}
+	return (idx - 1) & qf->qf_index_mask;
+}
+
+static inline int is_occupied(uint64_t elt)
+{
+	return elt & 1;
+}
+
+static inline uint64_t set_occupied(uint64_t elt)
+{
+	return elt | 1;
+}
+
+static inline uint64_t clr_occupied(uint64_t elt)
+{
+	return elt & ~1;
+}
+
+static inline int is_continuation(uint64_t elt)
+{
+	return elt & 2;
+}
+
+static inline uint64_t set_continuation(uint64_t elt)
+{
+	return elt | 2;
+}
+
+static inline uint64_t clr_continuation(uint64_t elt)
+{
+	return elt & ~2;
+}
+
+static inline int is_shifted(uint64_t elt)
+{
+	return elt & 4;
+}
+
+static inline uint64_t set_shifted(uint64_t elt)
+{
+	return elt | 4;
+}
+
+static inline uint64_t clr_shifted(uint64_t elt)
+{
+	return elt & ~4;
+}
+
+static inline uint64_t get_remainder(uint64_t elt)
+{
+	return elt >> 3;
+}
+
+static inline bool is_empty_element(uint64_t elt)
+{
+	return (elt & 7) == 0;
+}
+
+static inline bool is_cluster_start(uint64_t elt)
+{
+	return is_occupied(elt) && !is_continuation(elt) && !is_shifted(elt);
+}
+
+static inline bool is_run_start(uint64_t elt)
+{
+	return !is_continuation(elt) && (is_occupied(elt) || is_shifted(elt));
+}
+
+QF_TEMPLATE static inline uint64_t hash_to_quotient(QF *qf, uint64_t hash)
+{
+	return (hash >> qf->qf_rbits) & qf->qf_index_mask;
+}
+
+QF_TEMPLATE static inline uint64_t hash_to_remainder(QF *qf, uint64_t hash)
+{
+	return hash & qf->qf_rmask;
+}
+
+/*
+ * QF_EXPANDABLE tables take the quotient from the top of the hash, and store
+ * the r-1 bits below it with a one bit appended. Each expansion moves one
+ * more bit into the quotient and shifts zeros into the bottom of the
+ * remainder, so its lowest set bit marks where the fingerprint ends.
+ */
+QF_TEMPLATE static inline uint64_t age_quotient(QF *qf, uint64_t hash)
+{
+	return hash >> (64 - qf->qf_qbits);
+}
+
+QF_TEMPLATE static inline uint64_t age_remainder(QF *qf, uint64_t hash)
+{
+	return ((hash << qf->qf_qbits) >> (64 - qf->qf_rbits)) | 1;
+}
+
+/* Does the remainder rem hold a prefix of the full remainder fr? */
+static inline bool age_matches(uint64_t rem, uint64_t fr)
+{
+	return ((rem ^ fr) >> (__builtin_ctzll(rem) + 1)) == 0;
+}
+
+/* Is rem the remainder of an entry with no fingerprint bits left? */
+QF_TEMPLATE static inline bool age_empty(QF *qf, uint64_t rem)
+{
+	return (qf->qf_flags & QF_EXPANDABLE) &&
+		rem == 1ULL << (qf->qf_rbits - 1);
+}
+
+/* The canonical slot of a hash, for either kind of table. */
+QF_TEMPLATE static inline uint64_t home_slot(QF *qf, uint64_t hash)
+{
+	if (qf->qf_flags & QF_EXPANDABLE) {
+		return age_quotient(qf, hash);
+	}
+	return hash_to_quotient(qf, hash);
+}
+
+/* Does the table keep its metadata bits in words (QF_BLOCKED, QF_PLANES)? */
+QF_TEMPLATE static inline bool has_meta_words(QF *qf)
+{
+	return qf->qf_store == STORE_BLOCKED || qf->qf_store == STORE_PLANES;
+}
+
+/*
+ * Return word i of a bit sequence in the table: a metadata bitmap, or with
+ * REMAINDERS, the packed remainders (bit j * r starts slot j's remainder).
+ * Packed and aligned tables are a single sequence of (r+3)-bit slots.
+ */
+QF_TEMPLATE static inline uint64_t *seq_word(QF *qf, int kind, uint64_t i)
+{
+	uint64_t r = qf->qf_rbits;
+
+	switch (qf->qf_store) {
+	case STORE_PLANES:
+		return qf->qf_table + kind * nblocks(qf) + i;
+	case STORE_BLOCKED:
+		if (kind == REMAINDERS) {
+			return qf->qf_table + (i / r) * qf->qf_elem_bits +
+				REMAINDERS + i % r;
+		}
+		return qf->qf_table + i * qf->qf_elem_bits + kind;
+	default:
+		return qf->qf_table + i;
+	}
+}
+
+/* Return the `kind' metadata bits of slots [64 * w, 64 * w + 64). */
+QF_TEMPLATE static inline uint64_t meta_word(QF *qf, int kind, uint64_t w)
+{
+	return *seq_word(qf, kind, w);
+}
+
+/* Mask off the word bits past the end of a table with fewer than 64 slots. */
+QF_TEMPLATE static inline uint64_t word_slots(QF *qf)
+{
+	return qf->qf_nslots < 64 ? LOW_MASK(qf->qf_nslots) : ~0ULL;
+}
+
+/* Test `is_occupied' for slot idx without decoding the whole slot. */
+QF_TEMPLATE static inline bool slot_occupied(QF *qf, uint64_t idx)
+{
+	if (has_meta_words(qf)) {
+		return (meta_word(qf, OCCUPIEDS, idx / 64) >> (idx % 64)) & 1;
+	}
+	return is_occupied(get_elem(qf, idx));
+}
+
+/*
+ * Return the mask of the slot-aligned bits of word w in a packed table, i.e.
+ * the `is_occupied' bits, moved up by `bit' (2 for the `is_shifted' bits).
+ */
+QF_TEMPLATE static inline uint64_t slot_bits(QF *qf, uint64_t w, uint64_t bit)
+{
+	uint64_t n = qf->qf_elem_bits;
+	uint64_t m = 0;
+	for (uint64_t i = 0; i < 64; i += n) {
+		m |= 1ULL << i;
+	}
+	return m << (((n - (w * 64) % n) + bit) % n);
+}
+
+/* Return the index of the k-th (0-based) set bit in x. */
+static inline int select64(uint64_t x, int k)
+{
+	while (k--) {
+		x &= x - 1;
+	}
+	return __builtin_ctzll(x);
+}
+
+/*
+ * Runtime CPU dispatch: on x86-64 the run search is also compiled for BMI2
+ * (with POPCNT and LZCNT), and detect_cpu() picks a variant once, at load
+ * time, so one binary runs everywhere. The BMI2 variant selects with
+ * pdep/tzcnt, and uses pext to gather the metadata bits of packed and aligned
+ * tables, so they get the word-level search QF_BLOCKED and QF_PLANES use.
+ */
+QF_SHARED bool cpu_bmi2;
+
+/* Does this CPU have AVX2, for scan_run()? */
+QF_SHARED bool cpu_avx2;
+
+#ifdef QF_X86_64
+#ifndef QF_SHAPED
+static void detect_cpu(void) __attribute__((constructor));
+#endif
+
+QF_SHARED void detect_cpu(void)
+{
+	__builtin_cpu_init();
+	cpu_bmi2 = __builtin_cpu_supports("bmi2") &&
+		__builtin_cpu_supports("popcnt") &&
+		__builtin_cpu_supports("lzcnt");
+	cpu_avx2 = __builtin_cpu_supports("avx2");
+}
+
+#ifdef QF_SHAPED
+/* Initialized once, however many files include qf.hpp. */
+inline bool cpu_detected = (detect_cpu(), true);
+#endif
+
+TARGET_BMI2 static inline int select64_bmi2(uint64_t x, int k)
+{
+	return __builtin_ctzll(_pdep_u64(1ULL << k, x));
+}
+
+/*
+ * Gather the `kind' bits of slots [64 * w, 64 * w + 64) of a packed or aligned
+ * table. Those 64 slots take up exactly the n = r + 3 words from n * w on.
+ */
+QF_TEMPLATE TARGET_BMI2 static uint64_t gather_meta_word(QF *qf,
+		int kind, uint64_t w)
+{
+	uint64_t n = qf->qf_elem_bits;
+	uint64_t nwords = table_bytes(qf) / sizeof(uint64_t);
+	uint64_t period = slot_bits(qf, 0, 0);
+	uint64_t off = kind;	/* Of the first `kind' bit in word i. */
+	uint64_t bits = 0;
+	int nbits = 0;
+
+	for (uint64_t i = n * w; i < n * w + n && i < nwords; ++i) {
+		uint64_t x;
+		uint64_t m = period << off;
+		memcpy(&x, qf->qf_table + i, sizeof(x));
+		bits |= _pext_u64(x, m) << nbits;
+		nbits += __builtin_popcountll(m);
+		off = (off + n - 64 % n) % n;
+	}
+	return bits;
+}
+#endif
+
+/* select64() or select64_bmi2(), for the search bodies below. */
+static ALWAYS_INLINE int select_bits(uint64_t x, int k, bool bmi2)
+{
+#ifdef QF_X86_64
+	if (bmi2) {
+		return select64_bmi2(x, k);
+	}
+#endif
+	(void) bmi2;
+	return select64(x, k);
+}
+
+/* meta_word(), which with BMI2 also works for packed and aligned tables. */
+QF_TEMPLATE static ALWAYS_INLINE uint64_t search_word(QF *qf,
+		int kind, uint64_t w, bool bmi2)
+{
+#ifdef QF_X86_64
+	if (bmi2 && !has_meta_words(qf)) {
+		return gather_meta_word(qf, kind, w);
+	}
+#endif
+	(void) bmi2;
+	return meta_word(qf, kind, w);
+}
+
+/* Count the set `kind' bits of the slots in [lo, hi). */
+QF_TEMPLATE static ALWAYS_INLINE uint64_t count_range(QF *qf,
+		int kind, uint64_t lo, uint64_t hi, bool bmi2)
+{
+	uint64_t n = 0;
+	while (lo < hi) {
+		uint64_t bits = search_word(qf, kind, lo / 64, bmi2) >> (lo % 64);
+		uint64_t span = 64 - (lo % 64);
+		if (hi - lo < span) {
+			span = hi - lo;
+			bits &= LOW_MASK(span);
+		}
+		n += __builtin_popcountll(bits);
+		lo += span;
+	}
+	return n;
+}
+
+/* Find the start index of the run for fq with word-level rank/select. */
+QF_TEMPLATE static ALWAYS_INLINE uint64_t run_index_words(QF *qf,
+		uint64_t fq, bool bmi2)
+{
+	/*
+	 * The cluster starts at the last unshifted slot at or before fq. There
+	 * is no per-block offset to start from, so this walks back one word
+	 * of slots at a time.
+	 */
+	uint64_t w = fq / 64;
+	uint64_t bits = ~search_word(qf, SHIFTEDS, w, bmi2) &
+		(~0ULL >> (63 - fq % 64));
+	while (!bits) {
+		w = (w ? w : nblocks(qf)) - 1;
+		bits = ~search_word(qf, SHIFTEDS, w, bmi2) & word_slots(qf);
+	}
+	uint64_t b = w * 64 + 63 - __builtin_clzll(bits);
+
+	/* Each occupied quotient in (b, fq] owns one run ahead of fq's. */
+	uint64_t d;
+	if (b <= fq) {
+		d = count_range(qf, OCCUPIEDS, b + 1, fq + 1, bmi2);
+	} else {
+		d = count_range(qf, OCCUPIEDS, b + 1, qf->qf_nslots, bmi2) +
+			count_range(qf, OCCUPIEDS, 0, fq + 1, bmi2);
+	}
+	if (d == 0) {
+		return b;
+	}
+
+	/* Select the d-th run start (non-continuation slot) after b. */
+	uint64_t s = incr(qf, b);
+	while (true) {
+		w = s / 64;
+		bits = ~search_word(qf, CONTINUATIONS, w, bmi2) &
+			word_slots(qf) & (~0ULL << (s % 64));
+		uint64_t n = __builtin_popcountll(bits);
+		if (d <= n) {
+			return w * 64 + select_bits(bits, d - 1, bmi2);
+		}
+		d -= n;
+		s = (w + 1) * 64;
+		if (s >= qf->qf_nslots) {
+			s = 0;
+		}
+	}
+}
+
+QF_TEMPLATE static uint64_t find_run_index_words(QF *qf, uint64_t fq)
+{
+	return run_index_words(qf, fq, false);
+}
+
+#ifdef QF_X86_64
+QF_TEMPLATE TARGET_BMI2 static uint64_t find_run_index_bmi2(QF *qf, uint64_t fq)
+{
+	return run_index_words(qf, fq, true);
+}
+#endif
+
+/* Return the next occupied quotient after quot. */
+QF_TEMPLATE static uint64_t next_occupied(QF *qf, uint64_t quot)
+{
+	if (!has_meta_words(qf)) {
+		do {
+			quot = incr(qf, quot);
+		} while (!is_occupied(get_elem(qf, quot)));
+		return quot;
+	}
+
+	uint64_t s = incr(qf, quot);
+	while (true) {
+		uint64_t w = s / 64;
+		uint64_t bits = meta_word(qf, OCCUPIEDS, w) &
+			(~0ULL << (s % 64));
+		if (bits) {
+			return w * 64 + __builtin_ctzll(bits);
+		}
+		s = (w + 1) * 64;
+		if (!(qf->qf_flags & QF_NOWRAP) && s >= qf->qf_nslots) {
+			s = 0;
+		}
+	}
+}
+
+/* Find the start index of the run for fq (given that the run exists). */
+QF_TEMPLATE static uint64_t find_run_index(QF *qf, uint64_t fq)
+{
+#ifdef QF_X86_64
+	if (cpu_bmi2 && (has_meta_words(qf) || qf->qf_elem_bits < 64)) {
+		return find_run_index_bmi2(qf, fq);
+	}
+#endif
+	if (has_meta_words(qf)) {
+		return find_run_index_words(qf, fq);
+	}
+
+	/* Find the start of the cluster. */
+	uint64_t b = fq;
+	while (is_shifted(get_elem(qf, b))) {
+		b = decr(qf, b);
+	}
+
+	/* Find the start of the run for fq. */
+	uint64_t s = b;
+	while (b != fq) {
+		do {
+			s = incr(qf, s);
+		} while (is_continuation(get_elem(qf, s)));
+		b = next_occupied(qf, b);
+	}
+	return s;
+}
+
+#ifdef QF_X86_64
+/*
+ * Compare the 8 nbits-wide fields at bit offsets bit0 + i * stride of words,
+ * whose remainders start at bit rshift, against fr; see scan_lanes().
+ */
+TARGET_AVX2 static void compare_fields_avx2(const uint64_t *words,
+		uint64_t bit0, uint64_t stride, int nbits, int rshift, uint64_t fr,
+		uint32_t *ge, uint32_t *eq, uint32_t *cont)
+{
+	const long long *base = (const long long *) words;
+	__m256i lanes = _mm256_setr_epi64x(0, 1, 2, 3);
+	__m256i mask = _mm256_set1_epi64x(LOW_MASK(nbits));
+	__m256i frv = _mm256_set1_epi64x(fr);
+	__m256i two = _mm256_set1_epi64x(2);
+
+	*ge = *eq = *cont = 0;
+	for (int half = 0; half < 2; ++half) {
+		/* Load each field with an unaligned 8-byte gather. */
+		__m256i pos = _mm256_add_epi64(_mm256_set1_epi64x(bit0 +
+				4 * half * stride), _mm256_mul_epu32(lanes,
+				_mm256_set1_epi64x(stride)));
+		__m256i x = _mm256_i64gather_epi64(base,
+				_mm256_srli_epi64(pos, 3), 1);
+		x = _mm256_srlv_epi64(x, _mm256_and_si256(pos,
+				_mm256_set1_epi64x(7)));
+		x = _mm256_and_si256(x, mask);
+
+		/* Remainders are < 2^61, so signed compares are fine. */
+		__m256i rem = _mm256_srli_epi64(x, rshift);
+		__m256i gt = _mm256_cmpgt_epi64(rem, frv);
+		__m256i e = _mm256_cmpeq_epi64(rem, frv);
+		__m256i c = _mm256_cmpeq_epi64(_mm256_and_si256(x, two), two);
+		int shift = 4 * half;
+		*ge |= _mm256_movemask_pd(_mm256_castsi256_pd(
+				_mm256_or_si256(gt, e))) << shift;
+		*eq |= _mm256_movemask_pd(_mm256_castsi256_pd(e)) << shift;
+		*cont |= _mm256_movemask_pd(_mm256_castsi256_pd(c)) << shift;
+	}
+}
+#endif
+
+/*
+ * Compare the remainders of a batch of slots from s on against fr. Bit i of
+ * the masks is for slot s + i: *ge if its remainder is >= fr, *eq if it is
+ * fr, and *cont if the slot is a continuation. Returns the number of slots in
+ * the batch, or 0 if there is no vector kernel for this table or position.
+ */
+QF_TEMPLATE static int scan_lanes(QF *qf, uint64_t s, uint64_t fr,
+		uint32_t *ge, uint32_t *eq, uint32_t *cont)
+{
+#ifdef QF_X86_64
+	uint64_t nslots = table_slots(qf);
+	uint64_t n = qf->qf_elem_bits;
+	uint64_t r = qf->qf_rbits;
+
+	switch (qf->qf_store) {
+	case STORE_8: {
+		/* Aligned slots need only SSE2, which x86-64 always has. */
+		if (s + 16 > nslots) {
+			return 0;
+		}
+		__m128i x = _mm_loadu_si128((const __m128i *)
+				((const uint8_t *) qf->qf_table + s));
+		__m128i rem = _mm_and_si128(_mm_srli_epi16(x, 3),
+				_mm_set1_epi8(0x1f));
+		__m128i frv = _mm_set1_epi8((char) fr);
+		__m128i e = _mm_cmpeq_epi8(rem, frv);
+		__m128i two = _mm_set1_epi8(2);
+		*ge = _mm_movemask_epi8(_mm_or_si128(e,
+				_mm_cmpgt_epi8(rem, frv)));
+		*eq = _mm_movemask_epi8(e);
+		*cont = _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_and_si128(x, two), two));
+		return 16;
+	}
+	case STORE_16: {
+		if (s + 8 > nslots) {
+			return 0;
+		}
+		__m128i x = _mm_loadu_si128((const __m128i *)
+				((const uint16_t *) qf->qf_table + s));
+		__m128i rem = _mm_srli_epi16(x, 3);
+		__m128i frv = _mm_set1_epi16((short) fr);
+		__m128i e = _mm_cmpeq_epi16(rem, frv);
+		__m128i two = _mm_set1_epi16(2);
+		__m128i zero = _mm_setzero_si128();
+		__m128i g = _mm_or_si128(e, _mm_cmpgt_epi16(rem, frv));
+		__m128i c = _mm_cmpeq_epi16(_mm_and_si128(x, two), two);
+		*ge = _mm_movemask_epi8(_mm_packs_epi16(g, zero));
+		*eq = _mm_movemask_epi8(_mm_packs_epi16(e, zero));
+		*cont = _mm_movemask_epi8(_mm_packs_epi16(c, zero));
+		return 8;
+	}
+	case STORE_32: {
+		if (s + 4 > nslots) {
+			return 0;
+		}
+		__m128i x = _mm_loadu_si128((const __m128i *)
+				((const uint32_t *) qf->qf_table + s));
+		__m128i rem = _mm_srli_epi32(x, 3);
+		__m128i frv = _mm_set1_epi32((int) fr);
+		__m128i e = _mm_cmpeq_epi32(rem, frv);
+		__m128i two = _mm_set1_epi32(2);
+		__m128i g = _mm_or_si128(e, _mm_cmpgt_epi32(rem, frv));
+		__m128i c = _mm_cmpeq_epi32(_mm_and_si128(x, two), two);
+		*ge = _mm_movemask_ps(_mm_castsi128_ps(g));
+		*eq = _mm_movemask_ps(_mm_castsi128_ps(e));
+		*cont = _mm_movemask_ps(_mm_castsi128_ps(c));
+		return 4;
+	}
+	case STORE_BLOCKED:
+		/* The batch must stay within one block's remainders. */
+		if (!cpu_avx2 || r > 57 || s % 64 > 56 || s + 8 > nslots) {
+			return 0;
+		}
+		/* ...and the 8-byte gathers within the table. */
+		if (s / 64 + 1 == nblocks(qf) &&
+				((s % 64 + 7) * r) / 8 + 8 > r * 8) {
+			return 0;
+		}
+		compare_fields_avx2(get_block(qf, s) + REMAINDERS,
+				(s % 64) * r, r, r, 0, fr, ge, eq, cont);
+		*cont = (meta_word(qf, CONTINUATIONS, s / 64) >> (s % 64)) &
+			0xff;
+		return 8;
+	case STORE_PLANES:
+		/* The 8-byte gathers must stay within the table. */
+		if (!cpu_avx2 || r > 57 || s + 8 + 64 / r > nslots) {
+			return 0;
+		}
+		compare_fields_avx2(seq_word(qf, REMAINDERS, 0), s * r, r, r,
+				0, fr, ge, eq, cont);
+		*cont = get_bits(seq_word(qf, CONTINUATIONS, 0), s, 8, 0xff);
+		return 8;
+	default:
+		if (!cpu_avx2 || n > 57 || s + 8 + 64 / n > nslots) {
+			return 0;
+		}
+		compare_fields_avx2(qf->qf_table, s * n, n, n, 3, fr, ge, eq,
+				cont);
+		return 8;
+	}
+#else
+	(void) qf; (void) s; (void) fr; (void) ge; (void) eq; (void) cont;
+	return 0;
+#endif
+}
+
+/*
+ * Scan the sorted run which contains slot s, from s on, for the remainder fr.
+ * Returns the first slot whose remainder is >= fr, or the slot just past the
+ * run, and sets *found if that slot holds fr.
+ */
+QF_TEMPLATE static uint64_t scan_run(QF *qf, uint64_t s, uint64_t fr,
+		bool *found)
+{
+	/* Most runs are short, so the first slot is checked on its own. */
+	for (bool first = true; ; first = false) {
+		uint32_t ge = 0, eq = 0, cont = 0;
+		int n = first ? 0 : scan_lanes(qf, s, fr, &ge, &eq, &cont);
+		if (n == 0) {
+			uint64_t rem = get_remainder(get_elem(qf, s));
+			n = 1;
+			ge = rem >= fr;
+			eq = rem == fr;
+		}
+
+		/* Slot s is in the run; a non-continuation ends it. */
+		uint32_t ended = ~cont & (uint32_t) LOW_MASK(n) & ~1U;
+		uint32_t stop = (ge & (uint32_t) LOW_MASK(n)) | ended;
+		if (stop) {
+			int i = __builtin_ctz(stop);
+			*found = !((ended >> i) & 1) && ((eq >> i) & 1);
+			return (qf->qf_flags & QF_NOWRAP) ? s + i :
+				(s + i) & qf->qf_index_mask;
+		}
+
+		s = (qf->qf_flags & QF_NOWRAP) ? s + n :
+			(s + n) & qf->qf_index_mask;
+		if (!is_continuation(get_elem(qf, s))) {
+			*found = false;
+			return s;
+		}
+	}
+}
+
+/* find_clear() for a packed table, testing the metadata of a word at once. */
+QF_TEMPLATE static uint64_t find_clear_packed(QF *qf, int bits,
+		uint64_t from, uint64_t end)
+{
+	uint64_t n = qf->qf_elem_bits;
+	uint64_t nwords = (table_slots(qf) * n + 63) / 64;
+	uint64_t w = from * n / 64;
+	uint64_t first = ~0ULL << (from * n - w * 64);
+
+	for (; w * 64 < end * n; ++w, first = ~0ULL) {
+		/* A slot's metadata bits may spill into the next word. */
+		uint64_t lo = qf->qf_table[w];
+		uint64_t hi = (w + 1 < nwords) ? qf->qf_table[w + 1] : 0;
+		uint64_t set = 0;
+		for (int b = 0; b < 3; ++b) {
+			if (bits & (1 << b)) {
+				set |= b ? (lo >> b) | (hi << (64 - b)) : lo;
+			}
+		}
+		uint64_t clear = ~set & slot_bits(qf, w, 0) & first;
+		if (clear) {
+			uint64_t idx = (w * 64 + __builtin_ctzll(clear)) / n;
+			return idx < end ? idx : end;
+		}
+	}
+	return end;
+}
+
+/*
+ * Return the first slot in [from, end) which has none of the metadata `bits'
+ * (1 = is_occupied, 2 = is_continuation, 4 = is_shifted) set, or end.
+ */
+QF_TEMPLATE static uint64_t find_clear(QF *qf, int bits,
+		uint64_t from, uint64_t end)
+{
+	if (qf->qf_store == STORE_PACKED && qf->qf_elem_bits < 64) {
+		return find_clear_packed(qf, bits, from, end);
+	}
+	if (!has_meta_words(qf)) {
+		while (from < end && (get_elem(qf, from) & bits)) {
+			++from;
+		}
+		return from;
+	}
+
+	while (from < end) {
+		uint64_t w = from / 64;
+		uint64_t set = 0;
+		for (int kind = OCCUPIEDS; kind <= SHIFTEDS; ++kind) {
+			if (bits & (1 << kind)) {
+				set |= meta_word(qf, kind, w);
+			}
+		}
+		uint64_t clear = ~set & (~0ULL << (from % 64));
+		if (clear) {
+			uint64_t idx = w * 64 + __builtin_ctzll(clear);
+			return idx < end ? idx : end;
+		}
+		from = (w + 1) * 64;
+	}
+	return end;
+}
+
+/* Mask the bits of word w which fall in the bit range [lo, hi). */
+static inline uint64_t range_mask(uint64_t w, uint64_t lo, uint64_t hi)
+{
+	uint64_t m = ~0ULL;
+	if (lo > w * 64) {
+		m &= ~0ULL << (lo - w * 64);
+	}
+	if (hi < w * 64 + 64) {
+		m &= LOW_MASK(hi - w * 64);
+	}
+	return m;
+}
+
+/* Set bits [lo, hi) of the `kind' sequence. */
+QF_TEMPLATE static void fill_bits(QF *qf, int kind, uint64_t lo, uint64_t hi)
+{
+	for (uint64_t w = lo / 64; w * 64 < hi; ++w) {
+		*seq_word(qf, kind, w) |= range_mask(w, lo, hi);
+	}
+}
+
+/* Move bits [lo, hi) of the `kind' sequence up by k (0 < k < 64) bits. */
+QF_TEMPLATE static void move_bits_up(QF *qf, int kind, uint64_t lo,
+		uint64_t hi, int k)
+{
+	if (lo >= hi) {
+		return;
+	}
+	for (uint64_t w = (hi + k - 1) / 64; ; --w) {
+		uint64_t *p = seq_word(qf, kind, w);
+		uint64_t x = *p << k;
+		if (w * 64 > lo) {
+			x |= *seq_word(qf, kind, w - 1) >> (64 - k);
+		}
+		uint64_t m = range_mask(w, lo + k, hi + k);
+		*p = (*p & ~m) | (x & m);
+		if (w == (lo + k) / 64) {
+			break;
+		}
+	}
+}
+
+/* Move bits [lo, hi) of the `kind' sequence down by k (0 < k < 64) bits. */
+QF_TEMPLATE static void move_bits_down(QF *qf, int kind, uint64_t lo,
+		uint64_t hi, int k)
+{
+	if (lo >= hi) {
+		return;
+	}
+	for (uint64_t w = (lo - k) / 64; w * 64 < hi - k; ++w) {
+		uint64_t *p = seq_word(qf, kind, w);
+		uint64_t x = *p >> k;
+		if ((w + 1) * 64 < hi) {
+			x |= *seq_word(qf, kind, w + 1) << (64 - k);
+		}
+		uint64_t m = range_mask(w, lo - k, hi - k);
+		*p = (*p & ~m) | (x & m);
+	}
+}
+
+/* Slide the packed slots [s, e) up one slot; see slide_up(). */
+QF_TEMPLATE static void slide_packed_up(QF *qf, uint64_t s, uint64_t e)
+{
+	uint64_t n = qf->qf_elem_bits;
+	uint64_t lo = s * n;
+	uint64_t hi = e * n;
+	uint64_t *t = qf->qf_table;
+
+	if (lo >= hi) {
+		return;
+	}
+	for (uint64_t w = (hi + n - 1) / 64; ; --w) {
+		uint64_t x = t[w] << n;
+		if (w * 64 > lo) {
+			x |= t[w - 1] >> (64 - n);
+		}
+		uint64_t occ = slot_bits(qf, w, 0);
+		x = (x & ~occ) | (t[w] & occ) | slot_bits(qf, w, 2);
+		uint64_t m = range_mask(w, lo + n, hi + n);
+		t[w] = (t[w] & ~m) | (x & m);
+		if (w == (lo + n) / 64) {
+			break;
+		}
+	}
+}
+
+/* Slide the packed slots (s, e) down one slot; see slide_down(). */
+QF_TEMPLATE static void slide_packed_down(QF *qf, uint64_t s, uint64_t e)
+{
+	uint64_t n = qf->qf_elem_bits;
+	uint64_t lo = (s + 1) * n;
+	uint64_t hi = e * n;
+	uint64_t *t = qf->qf_table;
+
+	if (lo >= hi) {
+		return;
+	}
+	for (uint64_t w = (lo - n) / 64; w * 64 < hi - n; ++w) {
+		uint64_t x = t[w] >> n;
+		if ((w + 1) * 64 < hi) {
+			x |= t[w + 1] << (64 - n);
+		}
+		uint64_t occ = slot_bits(qf, w, 0);
+		x = (x & ~occ) | (t[w] & occ);
+		uint64_t m = range_mask(w, lo - n, hi - n);
+		t[w] = (t[w] & ~m) | (x & m);
+	}
+}
+
+/* Slide aligned slots of type T; a[j] keeps its own `is_occupied' bit. */
+#define SLIDE_UP(T) do {						\
+	T *a = (T *) qf->qf_table;					\
+	for (uint64_t j = e; j > s; --j) {				\
+		a[j] = (T) ((a[j - 1] & ~1U) | (a[j] & 1U) | 4U);	\
+	}								\
+} while (0)
+
+#define SLIDE_DOWN(T) do {						\
+	T *a = (T *) qf->qf_table;					\
+	for (uint64_t j = s; j + 1 < e; ++j) {				\
+		a[j] = (T) ((a[j + 1] & ~1U) | (a[j] & 1U));		\
+	}								\
+} while (0)
+
+/*
+ * Move the elements in [s, e) up into [s + 1, e + 1), where slot e is empty,
+ * a word at a time. `is_occupied' bits belong to the slots and stay put, and
+ * every moved element becomes shifted. Returns false if the layout can't do
+ * this, so the caller has to move one slot at a time.
+ */
+QF_TEMPLATE static bool slide_up(QF *qf, uint64_t s, uint64_t e)
+{
+	int r = qf->qf_rbits;
+
+	switch (qf->qf_store) {
+	case STORE_8:
+		SLIDE_UP(uint8_t);
+		return true;
+	case STORE_16:
+		SLIDE_UP(uint16_t);
+		return true;
+	case STORE_32:
+		SLIDE_UP(uint32_t);
+		return true;
+	case STORE_BLOCKED:
+	case STORE_PLANES:
+		move_bits_up(qf, CONTINUATIONS, s, e, 1);
+		fill_bits(qf, SHIFTEDS, s + 1, e + 1);
+		move_bits_up(qf, REMAINDERS, s * r, e * r, r);
+		return true;
+	default:
+		if (qf->qf_elem_bits >= 64) {
+			return false;
+		}
+		slide_packed_up(qf, s, e);
+		return true;
+	}
+}
+
+/*
+ * Move the elements in (s, e) down into [s, e - 1), leaving the `is_occupied'
+ * bits in place, like slide_up(). The caller clears slot e - 1 and fixes up
+ * `is_shifted'.
+ */
+QF_TEMPLATE static bool slide_down(QF *qf, uint64_t s, uint64_t e)
+{
+	int r = qf->qf_rbits;
+
+	switch (qf->qf_store) {
+	case STORE_8:
+		SLIDE_DOWN(uint8_t);
+		return true;
+	case STORE_16:
+		SLIDE_DOWN(uint16_t);
+		return true;
+	case STORE_32:
+		SLIDE_DOWN(uint32_t);
+		return true;
+	case STORE_BLOCKED:
+	case STORE_PLANES:
+		move_bits_down(qf, CONTINUATIONS, s + 1, e, 1);
+		move_bits_down(qf, SHIFTEDS, s + 1, e, 1);
+		move_bits_down(qf, REMAINDERS, (s + 1) * r, e * r, r);
+		return true;
+	default:
+		if (qf->qf_elem_bits >= 64) {
+			return false;
+		}
+		slide_packed_down(qf, s, e);
+		return true;
+	}
+}
+
+/* Insert elt into QF[s], shifting over elements as necessary. */
+QF_TEMPLATE static void insert_into(QF *qf, uint64_t s, uint64_t elt)
+{
+	/* Slide the rest of the cluster up into the next empty slot. */
+	uint64_t end = table_slots(qf);
+	uint64_t e = find_clear(qf, 7, s, end);
+	if (e < end && slide_up(qf, s, e)) {
+		set_elem(qf, s, slot_occupied(qf, s) ? set_occupied(elt) : elt);
+		return;
+	}
+
+	/* The cluster wraps around the end of the table. */
+	uint64_t prev;
+	uint64_t curr = elt;
+	bool empty;
+
+	do {
+		prev = get_elem(qf, s);
+		empty = is_empty_element(prev);
+		if (!empty) {
+			/* Fix up `is_shifted' and `is_occupied'. */
+			prev = set_shifted(prev);
+			if (is_occupied(prev)) {
+				curr = set_occupied(curr);
+				prev = clr_occupied(prev);
+			}
+		}
+		set_elem(qf, s, curr);
+		curr = prev;
+		s = incr(qf, s);
+	} while (!empty);
+}
+
+/*
+ * QF_COUNTING runs hold a group of slots for each remainder x, in ascending
+ * order of x. Up to two copies of x (three if x is 0) are stored as that many
+ * x's. More copies are stored as x, a counter, and x again, or as 0, a
+ * counter, 0, 0 for x = 0. The counter holds count - 3 (count - 4 for x = 0)
+ * as digits which are neither 0 nor x, most significant first. Its first slot
+ * must be below x, so that it cannot be taken for the next remainder, and a 0
+ * is put in front of it if it would not be. Three copies of x > 0 are stored
+ * as x, 0, x.
+ */
+
+/* The longest group: x, a 0, 64 digits in base 2 and x again. */
+#define COUNT_MAX_SLOTS 67
+
+/*
+ * Write the group for count copies of the remainder x into out, and return
+ * its length in slots.
+ */
+QF_TEMPLATE static int count_encode(QF *qf, uint64_t x,
+		uint64_t count, uint64_t *out)
+{
+	int n = 0;
+	out[n++] = x;
+	if (count <= (x ? 2U : 3U)) {
+		while ((uint64_t) n < count) {
+			out[n++] = x;
+		}
+		return n;
+	}
+	if (count == 3) {
+		out[n++] = 0;
+		out[n++] = x;
+		return n;
+	}
+
+	uint64_t base = qf->qf_rmask - (x != 0);
+	uint64_t v = count - (x ? 3 : 4);
+	uint64_t digits[64];
+	int k = 0;
+	do {
+		uint64_t d = v % base + 1;
+		digits[k++] = (x && d >= x) ? d + 1 : d;
+		v /= base;
+	} while (v);
+
+	if (x && digits[k - 1] > x) {
+		out[n++] = 0;
+	}
+	while (k) {
+		out[n++] = digits[--k];
+	}
+	out[n++] = x;
+	if (!x) {
+		out[n++] = 0;
+	}
+	return n;
+}
+
+/* Is QF[s] the last slot of its run? */
+QF_TEMPLATE static inline bool ends_run(QF *qf, uint64_t s)
+{
+	return !is_continuation(get_elem(qf, incr(qf, s)));
+}
+
+/*
+ * Decode the group which starts at QF[s] in a QF_COUNTING run. Sets *rem to
+ * its remainder and *count to its copies, and returns its last slot.
+ */
+QF_TEMPLATE static uint64_t count_decode(QF *qf, uint64_t s,
+		uint64_t *rem, uint64_t *count)
+{
+	uint64_t x = get_remainder(get_elem(qf, s));
+	*rem = x;
+	*count = 1;
+	if (ends_run(qf, s)) {
+		return s;
+	}
+
+	/* The next remainder is above x, and a counter starts below it. */
+	uint64_t t = incr(qf, s);
+	uint64_t d = get_remainder(get_elem(qf, t));
+	if (d == x) {
+		*count = 2;
+		if (x || ends_run(qf, t) ||
+				get_remainder(get_elem(qf, incr(qf, t)))) {
+			return t;
+		}
+		*count = 3;
+		return incr(qf, t);
+	}
+	if ((x && d > x) || ends_run(qf, t)) {
+		return s;
+	}
+	if (x && d == 0 && get_remainder(get_elem(qf, incr(qf, t))) == x) {
+		*count = 3;
+		return incr(qf, t);
+	}
+
+	/*
+	 * Read the counter up to its end marker. A lone 0 is followed by
+	 * remainders, which never hold two 0's in a row.
+	 */
+	uint64_t base = qf->qf_rmask - (x != 0);
+	uint64_t v = 0;
+	while (d != x) {
+		if (ends_run(qf, t)) {
+			return s;
+		}
+		if (d > x) {
+			--d;
+		}
+		if (d && x) {
+			--d;
+		}
+		v = v * base + d;
+		t = incr(qf, t);
+		d = get_remainder(get_elem(qf, t));
+	}
+	if (x) {
+		*count = v + 3;
+		return t;
+	}
+	if (ends_run(qf, t) || get_remainder(get_elem(qf, incr(qf, t)))) {
+		return s;
+	}
+	*count = v + 4;
+	return incr(qf, t);
+}
+
+/*
+ * scan_run() for a QF_COUNTING run, whose group at slot s is read first. Sets
+ * *count to the copies of fr if it is found.
+ */
+QF_TEMPLATE static uint64_t count_scan(QF *qf, uint64_t s,
+		uint64_t fr, bool *found, uint64_t *count)
+{
+	while (true) {
+		uint64_t rem;
+		uint64_t last = count_decode(qf, s, &rem, count);
+		if (rem >= fr) {
+			*found = rem == fr;
+			return s;
+		}
+		s = incr(qf, last);
+		if (!is_continuation(get_elem(qf, s))) {
+			*found = false;
+			return s;
+		}
+	}
+}
+
+/* Overwrite the remainders of the n slots from QF[s] on with those of out. */
+QF_TEMPLATE static void count_write(QF *qf, uint64_t s,
+		const uint64_t *out, int n)
+{
+	for (int i = 0; i < n; ++i, s = incr(qf, s)) {
+		uint64_t elt = get_elem(qf, s);
+		set_elem(qf, s, (elt & 7) | (out[i] << 3));
+	}
+}
+
+/*
+ * Add a copy to the group of count copies at QF[s], inserting the counter
+ * slot it may need at the end of the group.
+ */
+QF_TEMPLATE static void count_add(QF *qf, uint64_t s, uint64_t count)
+{
+	uint64_t x = get_remainder(get_elem(qf, s));
+	uint64_t out[COUNT_MAX_SLOTS];
+	int len = count_encode(qf, x, count, out);
+	int n = count_encode(qf, x, count + 1, out);
+
+	uint64_t last = s;
+	for (int i = 1; i < len; ++i) {
+		last = incr(qf, last);
+	}
+	for (; len < n; ++len) {
+		last = incr(qf, last);
+		insert_into(qf, last, set_shifted(set_continuation(0)));
+		++qf->qf_entries;
+	}
+	count_write(qf, s, out, n);
+}
+
+/*
+ * Add a copy of the fingerprint (fq, fr) to a QF_COUNTING table which has no
+ * slot to spare. Returns false unless fr is in the fq run already, and its
+ * group takes another copy in the slots it has.
+ */
+QF_TEMPLATE static bool count_in_place(QF *qf, uint64_t fq, uint64_t fr)
+{
+	if (!(qf->qf_flags & QF_COUNTING) || !slot_occupied(qf, fq)) {
+		return false;
+	}
+
+	bool found;
+	uint64_t count;
+	uint64_t s = count_scan(qf, find_run_index(qf, fq), fr, &found, &count);
+	uint64_t out[COUNT_MAX_SLOTS];
+	if (!found || count_encode(qf, fr, count + 1, out) >
+			count_encode(qf, fr, count, out)) {
+		return false;
+	}
+	count_add(qf, s, count);
+	return true;
+}
+
+QF_TEMPLATE static bool insert_entry(QF *qf, uint64_t fq, uint64_t fr)
+{
+	if (qf->qf_entries >= qf->qf_max_size) {
+		return count_in_place(qf, fq, fr);
+	}
+
+	uint64_t T_fq = get_elem(qf, fq);
+	uint64_t entry = (fr << 3) & ~7;
+
+	/* Special-case filling canonical slots to simplify insert_into(). */
+	if (is_empty_element(T_fq)) {
+		set_elem(qf, fq, set_occupied(entry));
+		++qf->qf_entries;
+		return true;
+	}
+
+	/* Shifting must not run into the sentinel past a QF_NOWRAP tail. */
+	if ((qf->qf_flags & QF_NOWRAP) &&
+			!is_empty_element(get_elem(qf, qf->qf_nslots - 1))) {
+		return count_in_place(qf, fq, fr);
+	}
+
+	if (!is_occupied(T_fq)) {
+		set_elem(qf, fq, set_occupied(T_fq));
+	}
+
+	uint64_t start = find_run_index(qf, fq);
+	uint64_t s = start;
+
+	if (is_occupied(T_fq)) {
+		/* Move the cursor to the insert position in the fq run. */
+		bool found;
+		if (qf->qf_flags & QF_COUNTING) {
+			uint64_t count;
+			s = count_scan(qf, start, fr, &found, &count);
+			if (found) {
+				count_add(qf, s, count);
+				return true;
+			}
+		} else {
+			/*
+			 * A QF_EXPANDABLE fingerprint may stand for different
+			 * hashes, which must not lose it to each other's
+			 * removal, so each hash gets its own copy.
+			 */
+			s = scan_run(qf, start, fr, &found);
+			if (found && !(qf->qf_flags & QF_EXPANDABLE)) {
+				return true;
+			}
+		}
+
+		if (s == start) {
+			/* The old start-of-run becomes a continuation. */
+			uint64_t old_head = get_elem(qf, start);
+			set_elem(qf, start, set_continuation(old_head));
+		} else {
+			/* The new element becomes a continuation. */
+			entry = set_continuation(entry);
+		}
+	}
+
+	/* Set the shifted bit if we can't use the canonical slot. */
+	if (s != fq) {
+		entry = set_shifted(entry);
+	}
+
+	insert_into(qf, s, entry);
+	++qf->qf_entries;
+	return true;
+}
+
+QF_TEMPLATE static bool insert_hash(QF *qf, uint64_t hash)
+{
+	if (qf->qf_flags & QF_EXPANDABLE) {
+		return insert_entry(qf, age_quotient(qf, hash),
+				age_remainder(qf, hash));
+	}
+	return insert_entry(qf, hash_to_quotient(qf, hash),
+			hash_to_remainder(qf, hash));
+}
+
+/*
+ * Returns the slot of the longest fingerprint in a QF_EXPANDABLE table which
+ * matches the hash, or UINT64_MAX. Runs hold fingerprints of all lengths, so
+ * the whole run is read, unless a full-length one matches first.
+ */
+QF_TEMPLATE static uint64_t age_find(QF *qf, uint64_t hash)
+{
+	uint64_t fq = age_quotient(qf, hash);
+	if (!slot_occupied(qf, fq)) {
+		return UINT64_MAX;
+	}
+
+	uint64_t fr = age_remainder(qf, hash);
+	uint64_t best = UINT64_MAX;
+	int best_pad = 64;
+	uint64_t s = find_run_index(qf, fq);
+	do {
+		uint64_t rem = get_remainder(get_elem(qf, s));
+		int pad = __builtin_ctzll(rem);
+		if (pad < best_pad && age_matches(rem, fr)) {
+			best = s;
+			best_pad = pad;
+			if (pad == 0) {
+				break;
+			}
+		}
+		s = incr(qf, s);
+	} while (is_continuation(get_elem(qf, s)));
+	return best;
+}
+
+/* The copies of the hash's fingerprint in a QF_COUNTING table. */
+QF_TEMPLATE static uint64_t count_hash(QF *qf, uint64_t hash)
+{
+	uint64_t fq = hash_to_quotient(qf, hash);
+	if (!slot_occupied(qf, fq)) {
+		return 0;
+	}
+
+	bool found;
+	uint64_t count;
+	count_scan(qf, find_run_index(qf, fq), hash_to_remainder(qf, hash),
+			&found, &count);
+	return found ? count : 0;
+}
+
+QF_TEMPLATE static bool lookup_hash(QF *qf, uint64_t hash)
+{
+	if (qf->qf_flags & QF_EXPANDABLE) {
+		return age_find(qf, hash) != UINT64_MAX;
+	}
+	if (qf->qf_flags & QF_COUNTING) {
+		return count_hash(qf, hash) != 0;
+	}
+
+	uint64_t fq = hash_to_quotient(qf, hash);
+	uint64_t fr = hash_to_remainder(qf, hash);
+
+	/* If this quotient has no run, give up. */
+	if (!slot_occupied(qf, fq)) {
+		return false;
+	}
+
+	/* Scan the sorted run for the target remainder. */
+	bool found;
+	scan_run(qf, find_run_index(qf, fq), fr, &found);
+	return found;
+}
+
+/*
+ * Clear `is_shifted' on the run starts in [lo, hi) which slid down into their
+ * canonical slots. quot is the quotient of the run before lo.
+ */
+QF_TEMPLATE static void fix_shifted(QF *qf, uint64_t lo, uint64_t hi,
+		uint64_t quot)
+{
+	uint64_t s = lo;
+	while ((s = find_clear(qf, 2, s, hi)) < hi) {
+		quot = next_occupied(qf, quot);
+		if (quot == s) {
+			set_elem(qf, s, clr_shifted(get_elem(qf, s)));
+		}
+		++s;
+	}
+}
+
+/* Remove the entry in QF[s] and slide the rest of the cluster forward. */
+QF_TEMPLATE static void delete_entry(QF *qf, uint64_t s, uint64_t quot)
+{
+	/* The slide ends at an empty slot or the start of the next cluster. */
+	uint64_t end = table_slots(qf);
+	uint64_t e = find_clear(qf, 6, s + 1, end);
+	if (e < end && slide_down(qf, s, e)) {
+		set_elem(qf, e - 1, 0);
+		fix_shifted(qf, s, e - 1, quot);
+		return;
+	}
+
+	/* The cluster wraps around the end of the table. */
+	uint64_t next;
+	uint64_t curr = get_elem(qf, s);
+	uint64_t sp = incr(qf, s);
+	uint64_t orig = s;
+
+	while (true) {
+		next = get_elem(qf, sp);
+		bool curr_occupied = is_occupied(curr);
+
+		if (is_empty_element(next) || is_cluster_start(next) || sp == orig) {
+			set_elem(qf, s, 0);
+			return;
+		} else {
+			/* Fix entries which slide into canonical slots. */
+			uint64_t updated_next = next;
+			if (is_run_start(next)) {
+				quot = next_occupied(qf, quot);
+				if (curr_occupied && quot == s) {
+					updated_next = clr_shifted(next);
+				}
+			}
+
+			set_elem(qf, s, curr_occupied ?
+					set_occupied(updated_next) :
+					clr_occupied(updated_next));
+			s = sp;
+			sp = incr(qf, sp);
+			curr = next;
+		}
+	}
+}
+
+/* Remove the entry in QF[s], which belongs to the run of quotient fq. */
+QF_TEMPLATE static void remove_slot(QF *qf, uint64_t fq, uint64_t s)
+{
+	uint64_t T_fq = get_elem(qf, fq);
+	uint64_t kill = (s == fq) ? T_fq : get_elem(qf, s);
+	bool replace_run_start = is_run_start(kill);
+
+	/* If we're deleting the last entry in a run, clear `is_occupied'. */
+	if (is_run_start(kill)) {
+		uint64_t next = get_elem(qf, incr(qf, s));
+		if (!is_continuation(next)) {
+			T_fq = clr_occupied(T_fq);
+			set_elem(qf, fq, T_fq);
+		}
+	}
+
+	delete_entry(qf, s, fq);
+
+	if (replace_run_start) {
+		uint64_t next = get_elem(qf, s);
+		uint64_t updated_next = next;
+		if (is_continuation(next)) {
+			/* The new start-of-run is no longer a continuation. */
+			updated_next = clr_continuation(next);
+		}
+		if (s == fq && is_run_start(updated_next)) {
+			/* The new start-of-run is in the canonical slot. */
+			updated_next = clr_shifted(updated_next);
+		}
+		if (updated_next != next) {
+			set_elem(qf, s, updated_next);
+		}
+	}
+
+	--qf->qf_entries;
+}
+
+/*
+ * Take a copy away from the group of count copies at QF[s] in the fq run,
+ * removing the whole group along with its last copy.
+ */
+QF_TEMPLATE static void count_remove(QF *qf, uint64_t fq, uint64_t s,
+		uint64_t count)
+{
+	uint64_t x = get_remainder(get_elem(qf, s));
+	uint64_t out[COUNT_MAX_SLOTS];
+	int len = count_encode(qf, x, count, out);
+	int n = count > 1 ? count_encode(qf, x, count - 1, out) : 0;
+
+	for (; len > MAX(n, 1); --len) {
+		remove_slot(qf, fq, incr(qf, s));
+	}
+	if (n == 0) {
+		remove_slot(qf, fq, s);
+	} else {
+		count_write(qf, s, out, n);
+	}
+}
+
+QF_TEMPLATE static bool remove_hash(QF *qf, uint64_t hash)
+{
+	if (qf->qf_flags & QF_EXPANDABLE) {
+		uint64_t s = age_find(qf, hash);
+		if (s != UINT64_MAX) {
+			remove_slot(qf, age_quotient(qf, hash), s);
+		}
+		return true;
+	}
+
+	/* Each copy of a fingerprint is counted, so any hash may go. */
+	uint32_t fbits = qf->qf_qbits + qf->qf_rbits;
+	if (!(qf->qf_flags & QF_COUNTING) && fbits < 64 && (hash >> fbits)) {
+		return false;
+	}
+
+	uint64_t fq = hash_to_quotient(qf, hash);
+	uint64_t fr = hash_to_remainder(qf, hash);
+
+	if (!slot_occupied(qf, fq) || !qf->qf_entries) {
+		return true;
+	}
+
+	/* Find the offending table index (or give up). */
+	bool found;
+	if (qf->qf_flags & QF_COUNTING) {
+		uint64_t count;
+		uint64_t s = count_scan(qf, find_run_index(qf, fq), fr, &found,
+				&count);
+		if (found) {
+			count_remove(qf, fq, s, count);
+		}
+		return true;
+	}
+	uint64_t s = scan_run(qf, find_run_index(qf, fq), fr, &found);
+	if (found) {
+		remove_slot(qf, fq, s);
+	}
+	return true;
+}
+
+#undef QF_TEMPLATE
+#undef QF_SHARED
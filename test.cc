@@ -8,8 +8,12 @@ extern "C" {
   #include "qf.c"
 }
 
+#include "qf.hpp"
+
 #define QBENCH 0
 
+#include <algorithm>
+#include <map>
 #include <set>
 #include <vector>
 #include <cassert>
@@ -44,7 +48,7 @@ static void qf_print(struct quotient_filter *qf)
     printf(" ");
   }
   printf("| is_shifted | is_continuation | is_occupied | remainder"
-      " nel=%u\n", qf->qf_entries);
+      " nel=%llu\n", (unsigned long long) qf->qf_entries);
 
   for (uint64_t idx = 0; idx < qf->qf_max_size; ++idx) {
     snprintf(buf, sizeof(buf), "%llu", idx);
@@ -77,7 +81,7 @@ static void qf_consistent(struct quotient_filter *qf)
   uint64_t start;
   uint64_t size = qf->qf_max_size;
   assert(qf->qf_entries <= size);
-  uint64_t last_run_elt;
+  uint64_t last_run_elt = 0;
   uint64_t visited = 0;
 
   if (qf->qf_entries == 0) {
@@ -116,8 +120,13 @@ static void qf_consistent(struct quotient_filter *qf)
     /* Check that remainders within runs are sorted. */
     if (!is_empty_element(elt)) {
       uint64_t rem = get_remainder(elt);
-      if (is_continuation(elt)) {
-        assert(rem > last_run_elt);
+      /*
+       * QF_COUNTING runs are checked by count_table(), and QF_EXPANDABLE runs
+       * keep a copy of a fingerprint for each hash.
+       */
+      if (is_continuation(elt) && !(qf->qf_flags & QF_COUNTING)) {
+        assert(rem > last_run_elt ||
+            ((qf->qf_flags & QF_EXPANDABLE) && rem == last_run_elt));
       }
       last_run_elt = rem;
       ++visited;
@@ -188,10 +197,29 @@ static void ht_check(struct quotient_filter *qf, set<uint64_t> &keys)
     uint64_t hash = *it;
     assert(qf_may_contain(qf, hash));
   }
+
+  /* Batched lookups agree with single ones, at any prefetch distance. */
+  vector<uint64_t> hashes(keys.begin(), keys.end());
+  for (size_t i = 0; i < keys.size() + 10; ++i) {
+    hashes.push_back(rand64());
+  }
+  vector<uint64_t> out((hashes.size() + 63) / 64, ~0ULL);
+  qf->qf_prefetch = rand() % 80;
+  qf_may_contain_batch(qf, hashes.data(), hashes.size(), out.data());
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    bool hit = (out[i / 64] >> (i % 64)) & 1;
+    assert(hit == qf_may_contain(qf, hashes[i]));
+  }
 }
 
 static void qf_test(struct quotient_filter *qf)
 {
+  /* The reported table size covers the whole allocation. */
+  size_t bytes = (qf->qf_flags & QF_MMAP_FLAGS) ? mapping_bytes(qf) :
+    table_bytes(qf);
+  assert(qf_table_size_flags(qf->qf_qbits, qf->qf_rbits, qf->qf_flags) ==
+      bytes);
+
   /* Basic get/set tests. */
   uint64_t idx;
   uint64_t size = qf->qf_max_size;
@@ -239,154 +267,2336 @@ static void qf_test(struct quotient_filter *qf)
     }
     ht_check(qf, keys);
 
+    /* Iteration yields exactly the keys, in ascending order. */
     struct qf_iterator qfi;
     qfi_start(qf, &qfi);
-    while (!qfi_done(qf, &qfi)) {
-      uint64_t hash = qfi_next(qf, &qfi);
-      assert(keys.count(hash));
+    set<uint64_t>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+      assert(!qfi_done(qf, &qfi));
+      assert(qfi_next(qf, &qfi) == *it);
     }
+    assert(qfi_done(qf, &qfi));
   }
 }
 
-/* Fill up the QF (at least partially). */
-static void random_fill(struct quotient_filter *qf)
+/* Check that QuotientFilter<Q, R> matches qf.c, down to the table bits. */
+template <uint32_t Q, uint32_t R>
+static void qf_test_template()
 {
+  struct quotient_filter qf;
+  QuotientFilter<Q, R> tqf;
+  if (!qf_init_flags(&qf, Q, R, 0)) {
+    fail(&qf, "init-template");
+  }
+
   set<uint64_t> keys;
-  uint64_t elts = ((uint64_t) rand()) % qf->qf_max_size;
-  while (elts) {
-    ht_put(qf, keys);
-    --elts;
+  for (uint32_t round = 0; round < ROUNDS_MAX / 10; ++round) {
+    while (qf.qf_entries < qf.qf_max_size) {
+      uint64_t hash = genhash(&qf, true, keys);
+      assert(qf_insert(&qf, hash));
+      assert(tqf.insert(hash));
+      keys.insert(hash);
+    }
+
+    while (qf.qf_entries > qf.qf_max_size / 2) {
+      set<uint64_t>::iterator it = keys.begin();
+      advance(it, rand64() % keys.size());
+      assert(qf_remove(&qf, *it));
+      assert(tqf.remove(*it));
+      keys.erase(it);
+    }
+
+    assert(tqf.entries() == qf.qf_entries);
+    assert(!memcmp(tqf.table(), qf.qf_table, table_bytes(&qf)));
+    for (uint32_t i = 0; i < qf.qf_max_size; ++i) {
+      uint64_t hash = rand64();
+      assert(tqf.may_contain(hash) == qf_may_contain(&qf, hash));
+    }
   }
-  qf_consistent(qf);
+  qf_destroy(&qf);
 }
 
-/* Check if @lhs is a subset of @rhs. */
-static void subsetof(struct quotient_filter *lhs, struct quotient_filter *rhs)
+/* Check a QF_NOWRAP filter against a set, including its iteration order. */
+static void qf_test_nowrap(uint32_t q, uint32_t r, uint32_t flags)
 {
-  struct qf_iterator qfi;
-  qfi_start(lhs, &qfi);
-  while (!qfi_done(lhs, &qfi)) {
-    uint64_t hash = qfi_next(lhs, &qfi);
-    assert(qf_may_contain(rhs, hash));
+  struct quotient_filter qf;
+  if (!qf_init_flags(&qf, q, r, flags | QF_NOWRAP)) {
+    fail(&qf, "init-nowrap");
+  }
+  assert(qf_table_size_flags(q, r, flags | QF_NOWRAP) == table_bytes(&qf));
+
+  set<uint64_t> keys;
+  uint64_t mask = LOW_MASK(q + r);
+  for (uint32_t round = 0; round < ROUNDS_MAX / 10; ++round) {
+    /* Fill up the QF, or its overflow tail. */
+    while (qf.qf_entries < qf.qf_max_size) {
+      uint64_t hash = rand64() & mask;
+      if (keys.count(hash)) {
+        continue;
+      }
+      if (!qf_insert(&qf, hash)) {
+        assert(!is_empty_element(get_elem(&qf, qf.qf_nslots - 1)));
+        break;
+      }
+      keys.insert(hash);
+    }
+
+    while (qf.qf_entries > qf.qf_max_size / 2) {
+      set<uint64_t>::iterator it = keys.begin();
+      advance(it, rand64() % keys.size());
+      assert(qf_remove(&qf, *it));
+      assert(!qf_may_contain(&qf, *it));
+      keys.erase(it);
+    }
+
+    /* Nothing wraps, and the sentinel past the tail stays empty. */
+    assert(!is_shifted(get_elem(&qf, 0)));
+    assert(get_elem(&qf, qf.qf_nslots) == 0);
+    uint64_t used = 0;
+    for (uint64_t idx = 0; idx < qf.qf_nslots; ++idx) {
+      uint64_t elt = get_elem(&qf, idx);
+      if (is_continuation(elt)) {
+        assert(is_shifted(elt));
+        uint64_t prev = get_elem(&qf, idx - 1);
+        assert(get_remainder(elt) > get_remainder(prev));
+      }
+      used += !is_empty_element(elt);
+    }
+    assert(used == qf.qf_entries && used == keys.size());
+
+    set<uint64_t>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+      assert(qf_may_contain(&qf, *it));
+    }
+
+    /* Iteration yields exactly the keys, in ascending order. */
+    struct qf_iterator qfi;
+    qfi_start(&qf, &qfi);
+    for (it = keys.begin(); it != keys.end(); ++it) {
+      assert(!qfi_done(&qf, &qfi));
+      assert(qfi_next(&qf, &qfi) == *it);
+    }
+    assert(qfi_done(&qf, &qfi));
   }
+  qf_destroy(&qf);
 }
 
-/* Check if @qf contains both @qf1 and @qf2. */
-static void supersetof(struct quotient_filter *qf, struct quotient_filter *qf1,
-    struct quotient_filter *qf2)
+/* Overflow the tail of a QF_NOWRAP filter, then drain it again. */
+static void qf_test_nowrap_tail(uint32_t flags)
 {
-  struct qf_iterator qfi;
-  qfi_start(qf, &qfi);
-  while (!qfi_done(qf, &qfi)) {
-    uint64_t hash = qfi_next(qf, &qfi);
-    assert(qf_may_contain(qf1, hash) || qf_may_contain(qf2, hash));
+  struct quotient_filter qf;
+  const uint32_t q = 8, r = 12;
+  if (!qf_init_flags(&qf, q, r, flags | QF_NOWRAP)) {
+    fail(&qf, "init-nowrap-tail");
+  }
+
+  uint64_t fq = qf.qf_index_mask;
+  uint64_t n = 0;
+  while (qf_insert(&qf, (fq << r) | n)) {
+    ++n;
   }
+  assert(n == qf.qf_nslots - fq);
+  assert(get_elem(&qf, qf.qf_nslots) == 0);
+  for (uint64_t i = 0; i < n; ++i) {
+    assert(qf_may_contain(&qf, (fq << r) | i));
+  }
+  for (uint64_t i = 0; i < n; ++i) {
+    assert(qf_remove(&qf, (fq << r) | i));
+    assert(!qf_may_contain(&qf, (fq << r) | i));
+  }
+  assert(qf.qf_entries == 0);
+  for (uint64_t idx = 0; idx <= qf.qf_nslots; ++idx) {
+    assert(get_elem(&qf, idx) == 0);
+  }
+  qf_destroy(&qf);
 }
 
-static void qf_bench()
+/* Check long runs, which scan_run() compares a batch of slots at a time. */
+static void qf_test_long_runs(uint32_t r, uint32_t flags)
 {
   struct quotient_filter qf;
-  const uint32_t q_large = 28;
-  const uint32_t q_small = 16;
-  const uint32_t nlookups = 1000000;
-  struct timeval tv1, tv2;
-  uint64_t sec;
+  const uint32_t q = min<uint32_t>(8, 64 - r);
+  if (!qf_init_flags(&qf, q, r, flags)) {
+    fail(&qf, "init-long-runs");
+  }
 
-  /* Test random inserts + lookups. */
-  uint32_t ninserts = (3 * (1 << q_large) / 4);
-  printf("Testing %u random inserts and %u lookups", ninserts, nlookups);
-  fflush(stdout);
-  qf_init(&qf, q_large, 1);
-  gettimeofday(&tv1, NULL);
-  while (qf.qf_entries < ninserts) {
-    assert(qf_insert(&qf, (uint64_t) rand()));
-    if (qf.qf_entries % 10000000 == 0) {
-      printf(".");
-      fflush(stdout);
+  /* Even remainders go into the run for quotient 3, in random order. */
+  uint64_t n = min<uint64_t>(150, (qf.qf_rmask + 1) / 2);
+  n = min<uint64_t>(n, qf.qf_max_size - 4);
+  vector<uint64_t> rems;
+  for (uint64_t i = 0; i < n; ++i) {
+    rems.push_back(2 * i);
+  }
+  for (uint64_t i = n; i > 1; --i) {
+    swap(rems[i - 1], rems[rand64() % i]);
+  }
+  for (uint64_t i = 0; i < n; ++i) {
+    assert(qf_insert(&qf, (3ULL << r) | rems[i]));
+    assert(qf_insert(&qf, (4ULL << r) | (i % 2)));
+  }
+  assert(qf.qf_entries == n + min<uint64_t>(n, 2));
+  if (!(flags & QF_NOWRAP)) {
+    qf_consistent(&qf);
+  }
+
+  for (uint64_t i = 0; i < n; ++i) {
+    assert(qf_may_contain(&qf, (3ULL << r) | (2 * i)));
+    assert(qf_insert(&qf, (3ULL << r) | (2 * i)));
+    if (2 * i + 1 <= qf.qf_rmask) {
+      assert(!qf_may_contain(&qf, (3ULL << r) | (2 * i + 1)));
     }
   }
-  for (uint32_t i = 0; i < nlookups; ++i) {
-    qf_may_contain(&qf, (uint64_t) rand());
+  assert(qf.qf_entries == n + min<uint64_t>(n, 2));
+
+  for (uint64_t i = 0; i < n; ++i) {
+    assert(qf_remove(&qf, (3ULL << r) | rems[i]));
+    assert(!qf_may_contain(&qf, (3ULL << r) | rems[i]));
+  }
+  assert(qf.qf_entries == min<uint64_t>(n, 2));
+  if (!(flags & QF_NOWRAP)) {
+    qf_consistent(&qf);
   }
-  gettimeofday(&tv2, NULL);
-  sec = tv2.tv_sec - tv1.tv_sec;
-  printf(" done (%llu seconds).\n", sec);
-  fflush(stdout);
   qf_destroy(&qf);
+}
 
-  /* Create a large cluster. Test random lookups. */
-  qf_init(&qf, q_small, 1);
-  printf("Testing %u contiguous inserts and %u lookups", 1 << q_small,
-      nlookups);
-  fflush(stdout);
-  gettimeofday(&tv1, NULL);
-  for (uint64_t quot = 0; quot < (1 << (q_small - 1)); ++quot) {
-    uint64_t hash = quot << 1;
-    assert(qf_insert(&qf, hash));
-    assert(qf_insert(&qf, hash | 1));
-    if (quot % 2000 == 0) {
-      printf(".");
-      fflush(stdout);
+/* Check that @qf holds exactly the same slots as @ref. */
+static void same_table(struct quotient_filter *qf, struct quotient_filter *ref)
+{
+  assert(qf->qf_entries == ref->qf_entries);
+  for (uint64_t idx = 0; idx < table_slots(qf); ++idx) {
+    if (get_elem(qf, idx) != get_elem(ref, idx)) {
+      fail(qf, "same-table");
     }
   }
-  for (uint32_t i = 0; i < nlookups; ++i) {
-    qf_may_contain(&qf, (uint64_t) rand());
-    if (i % 50000 == 0) {
-      printf(".");
-      fflush(stdout);
+  if (!(qf->qf_flags & QF_NOWRAP)) {
+    qf_consistent(qf);
+  }
+}
+
+/*
+ * qf_bulk_load() and qf_bulk_build() must build the same table as repeated
+ * qf_insert() calls.
+ */
+static void qf_test_bulk_load(uint32_t q, uint32_t r, uint32_t flags)
+{
+  struct quotient_filter qf, ref;
+  if (!qf_init_flags(&qf, q, r, flags) || !qf_init_flags(&ref, q, r, flags)) {
+    fail(&qf, "init-bulk");
+  }
+
+  uint64_t mask = LOW_MASK(q + r);
+  for (uint32_t round = 0; round < ROUNDS_MAX / 50; ++round) {
+    /* Crowd some rounds into the last quotients, so that clusters wrap. */
+    uint64_t n = rand64() % (qf.qf_max_size + 1);
+    uint64_t top = (round % 2) ? (1ULL << (q - 1)) << r : 0;
+    vector<uint64_t> hashes;
+    for (uint64_t i = 0; i < n && qf.qf_entries < qf.qf_max_size; ++i) {
+      uint64_t hash = (rand64() & mask) | top;
+      if (qf_insert(&ref, hash)) {
+        hashes.push_back(hash);
+        if (rand() % 8 == 0) {
+          hashes.push_back(hash);
+        }
+      }
+    }
+
+    /* Only the fingerprints are sorted; the high bits are ignored. */
+    for (size_t i = 0; i < hashes.size() && q + r < 64; ++i) {
+      hashes[i] |= rand64() & ~mask;
+    }
+    vector<uint64_t> sorted(hashes);
+    for (size_t i = 0; i < sorted.size(); ++i) {
+      sorted[i] &= mask;
+    }
+    sort(sorted.begin(), sorted.end());
+
+    uint64_t probe = rand64() & mask;
+    if (!qf_bulk_load(&qf, sorted.data(), sorted.size())) {
+      fail(&qf, "bulk-load");
+    }
+    same_table(&qf, &ref);
+    if (qf.qf_entries > 0) {
+      assert(!qf_bulk_load(&qf, &probe, 1));
+    }
+    qf_clear(&qf);
+
+    if (!qf_bulk_build(&qf, hashes.data(), hashes.size(), 1 + rand() % 8)) {
+      fail(&qf, "bulk-build");
     }
+    same_table(&qf, &ref);
+    assert(hashes == sorted);
+    qf_clear(&qf);
+    qf_clear(&ref);
   }
-  gettimeofday(&tv2, NULL);
-  sec = tv2.tv_sec - tv1.tv_sec;
-  printf(" done (%llu seconds).\n", sec);
-  fflush(stdout);
+
+  /* An empty input leaves the QF empty. */
+  assert(qf_bulk_load(&qf, NULL, 0) && qf_bulk_build(&qf, NULL, 0, 4));
+  assert(qf.qf_entries == 0);
+
+  /* Unsorted hashes, and too many fingerprints, are refused. */
+  uint64_t bad[] = {1, 0};
+  assert(!qf_bulk_load(&qf, bad, 2));
+  vector<uint64_t> all(qf.qf_max_size + 1);
+  for (uint64_t i = 0; i < all.size(); ++i) {
+    all[i] = i;
+  }
+  assert(!qf_bulk_load(&qf, &all[0], all.size()));
+  assert(!qf_bulk_build(&qf, &all[0], all.size(), 4));
+  assert(qf.qf_entries == 0);
+
   qf_destroy(&qf);
+  qf_destroy(&ref);
 }
 
-int main()
+/*
+ * qf_merge_into() must build the same table as qf_insert() calls, including
+ * when the output is as narrow as the inputs and its clusters wrap.
+ */
+static void qf_test_merge_into(uint32_t q, uint32_t r, uint32_t flags)
 {
-  srand(0);
+  struct quotient_filter qf1, qf2, qfout, ref;
+  if (!qf_init_flags(&qf1, q, r, flags) ||
+      !qf_init_flags(&qf2, q, r, flags) ||
+      !qf_init_flags(&qfout, q, r, flags) ||
+      !qf_init_flags(&ref, q, r, flags)) {
+    fail(&qf1, "init-merge-into");
+  }
 
-#if QBENCH
-  qf_bench();
-#else
-  for (uint32_t q = 1; q <= Q_MAX; ++q) {
-    printf("Starting rounds for qf_test::q=%u\n", q);
+  uint64_t mask = LOW_MASK(q + r);
+  for (uint32_t round = 0; round < ROUNDS_MAX / 50; ++round) {
+    /* Crowd some rounds into the last quotients, so that clusters wrap. */
+    uint64_t top = (round % 2) ? (1ULL << (q - 1)) << r : 0;
+    uint64_t n = rand64() % (qf1.qf_max_size / 2 + 1);
+    for (uint64_t i = 0; i < n; ++i) {
+      uint64_t hash = (rand64() & mask) | top;
+      if (qf_insert(&ref, hash)) {
+        assert(qf_insert(i % 2 ? &qf1 : &qf2, hash));
+        if (rand() % 4 == 0) {
+          qf_insert(i % 2 ? &qf2 : &qf1, hash);
+        }
+      }
+    }
 
-#pragma omp parallel for
-    for (uint32_t r = 1; r <= R_MAX; ++r) {
-      struct quotient_filter qf;
-      if (!qf_init(&qf, q, r)) {
-        fail(&qf, "init-1");
+    if (!qf_merge_into(&qf1, &qf2, &qfout)) {
+      fail(&qfout, "merge-into");
+    }
+    same_table(&qfout, &ref);
+
+    qf_clear(&qf1);
+    qf_clear(&qf2);
+    qf_clear(&ref);
+  }
+
+  /* A union which does not fit leaves qfout empty. */
+  for (uint64_t i = 0; i < qf1.qf_max_size; ++i) {
+    assert(qf_insert(&qf1, i << r));
+    assert(qf_insert(&qf2, (i << r) | 1));
+  }
+  assert(!qf_merge_into(&qf1, &qf2, &qfout));
+  assert(qfout.qf_entries == 0);
+
+  qf_destroy(&qf1);
+  qf_destroy(&qf2);
+  qf_destroy(&qfout);
+  qf_destroy(&ref);
+}
+
+/*
+ * qf_union_into() must leave dst as qf_insert() would, or untouched if src
+ * does not fit.
+ */
+static void qf_test_union_into(uint32_t q, uint32_t r, uint32_t flags)
+{
+  for (uint32_t round = 0; round < ROUNDS_MAX / 50; ++round) {
+    /* Odd rounds cut down a wider src. */
+    uint32_t sr = r + round % 2;
+    struct quotient_filter dst, src, base, ref;
+    if (!qf_init_flags(&dst, q, r, flags) ||
+        !qf_init_flags(&src, q, sr, flags) ||
+        !qf_init_flags(&base, q, r, flags) ||
+        !qf_init_flags(&ref, q, r, flags)) {
+      fail(&dst, "init-union-into");
+    }
+
+    /*
+     * Crowd some rounds into the last quotients, so that clusters wrap. Every
+     * other such round spreads src out, so that walks from a low quotient
+     * cross the wrapped clusters.
+     */
+    uint64_t top = (round % 4 >= 2) ? (1ULL << (q - 1)) << r : 0;
+    uint64_t stop = (round % 4 == 2) ? top : 0;
+    uint64_t n = rand64() % (3 * dst.qf_max_size / 4 + 1);
+    for (uint64_t i = 0; i < n; ++i) {
+      uint64_t hash = (rand64() & LOW_MASK(q + r)) | top;
+      if (qf_insert(&dst, hash)) {
+        assert(qf_insert(&base, hash));
+        assert(qf_insert(&ref, hash));
+        if (rand() % 4 == 0) {
+          qf_insert(&src, hash);
+        }
       }
-      qf_test(&qf);
-      qf_destroy(&qf);
     }
+    n = rand64() % (dst.qf_max_size / 2 + 1);
+    for (uint64_t i = 0; i < n; ++i) {
+      qf_insert(&src, (rand64() & LOW_MASK(q + sr)) | stop);
+    }
+
+    /*
+     * src fits if qf_insert() takes each of its new fingerprints in order.
+     * It refuses even duplicates once the table is full.
+     */
+    bool fits = true;
+    struct qf_iterator qfi;
+    qfi_start(&src, &qfi);
+    while (!qfi_done(&src, &qfi) && fits) {
+      uint64_t hash = qfi_next(&src, &qfi) & LOW_MASK(q + r);
+      fits = qf_may_contain(&ref, hash) || qf_insert(&ref, hash);
+    }
+
+    assert(qf_union_into(&dst, &src) == fits);
+    same_table(&dst, fits ? &ref : &base);
+
+    qf_destroy(&dst);
+    qf_destroy(&src);
+    qf_destroy(&base);
+    qf_destroy(&ref);
   }
 
-  for (uint32_t q1 = 1; q1 <= Q_MAX; ++q1) {
-    for (uint32_t r1 = 1; r1 <= R_MAX; ++r1) {
-      for (uint32_t q2 = 1; q2 <= Q_MAX; ++q2) {
-        printf("Starting rounds for qf_merge::q1=%u,q2=%u\n", q1, q2);
+  /*
+   * The run of quotient 5 wraps into slot 0, where the run of 7 starts. The
+   * walk from 0 to 7 goes once around the table, and must end up there.
+   */
+  struct quotient_filter dst, src;
+  if (q == 3 && r == 7) {
+    if (!qf_init_flags(&dst, q, r, flags) ||
+        !qf_init_flags(&src, q, r, flags)) {
+      fail(&dst, "init-union-into");
+    }
+    const uint64_t hashes[] = {0x2c0, 0x2c3, 0x2de, 0x3a0};
+    for (size_t i = 0; i < 4; ++i) {
+      assert(qf_insert(&dst, hashes[i]));
+    }
+    assert(qf_insert(&src, 0x027) && qf_insert(&src, 0x3f6));
+    assert(qf_union_into(&dst, &src));
+    assert(qf_may_contain(&dst, 0x027) && qf_may_contain(&dst, 0x3f6));
+    assert(!qf_may_contain(&dst, 0x2f6) && dst.qf_entries == 6);
+    if (!(flags & QF_NOWRAP)) {
+      qf_consistent(&dst);
+    }
+    qf_destroy(&dst);
+    qf_destroy(&src);
+  }
 
-#pragma omp parallel for
-        for (uint32_t r2 = 1; r2 <= R_MAX; ++r2) {
-          struct quotient_filter qf;
-          struct quotient_filter qf1, qf2;
-          if (!qf_init(&qf1, q1, r1) || !qf_init(&qf2, q2, r2)) {
-            fail(&qf1, "init-2");
-          }
+  /* A narrower src would lose hashes. */
+  if (!qf_init_flags(&dst, q, r + 1, flags) ||
+      !qf_init_flags(&src, q, r, flags)) {
+    fail(&dst, "init-union-into");
+  }
+  assert(!qf_union_into(&dst, &src));
+  qf_destroy(&dst);
+  qf_destroy(&src);
+}
 
-          random_fill(&qf1);
-          random_fill(&qf2);
-          assert(qf_merge(&qf1, &qf2, &qf));
-          qf_consistent(&qf);
-          subsetof(&qf1, &qf);
-          subsetof(&qf2, &qf);
-          supersetof(&qf, &qf1, &qf2);
+/* qf_split() must write the halves that qf_insert() would. */
+static void qf_test_split(uint32_t q, uint32_t r, uint32_t flags)
+{
+  for (uint32_t round = 0; round < ROUNDS_MAX / 50; ++round) {
+    struct quotient_filter qf, lo, hi, ref[2];
+    if (!qf_init_flags(&qf, q, r, flags) ||
+        !qf_init_flags(&ref[0], q - 1, r, flags) ||
+        !qf_init_flags(&ref[1], q - 1, r, flags)) {
+      fail(&qf, "init-split");
+    }
+
+    /* Skew some rounds to one half, and crowd the end of each half. */
+    uint64_t half = 1ULL << (q - 1 + r);
+    uint64_t top = (round % 2) ? half / 2 : 0;
+    uint64_t skew = (round % 4 >= 2) ? half : 0;
+    uint64_t n = rand64() % (qf.qf_max_size + 1);
+    for (uint64_t i = 0; i < n; ++i) {
+      uint64_t hash = (rand64() & LOW_MASK(q + r)) | top;
+      if (i % 2) {
+        hash |= skew;
+      }
+      qf_insert(&qf, hash);
+    }
+
+    bool fits = true;
+    struct qf_iterator qfi;
+    qfi_start(&qf, &qfi);
+    while (!qfi_done(&qf, &qfi)) {
+      uint64_t hash = qfi_next(&qf, &qfi);
+      fits &= qf_insert(&ref[(hash & half) != 0], hash & (half - 1));
+    }
+
+    assert(qf_split(&qf, &lo, &hi) == fits);
+    if (fits) {
+      same_table(&lo, &ref[0]);
+      same_table(&hi, &ref[1]);
+      qf_destroy(&lo);
+      qf_destroy(&hi);
+    }
+    qf_destroy(&qf);
+    qf_destroy(&ref[0]);
+    qf_destroy(&ref[1]);
+  }
+}
+
+/*
+ * qf_expand() must write the table that qf_insert() would, down to r = 1, and
+ * keep every hash.
+ */
+static void qf_test_expand(uint32_t q, uint32_t r, uint32_t flags)
+{
+  for (uint32_t round = 0; round < ROUNDS_MAX / 100; ++round) {
+    struct quotient_filter qf;
+    if (!qf_init_flags(&qf, q, r, flags)) {
+      fail(&qf, "init-expand");
+    }
+
+    /* Crowd some rounds into the last quotients, so that clusters wrap. */
+    uint64_t top = (round % 2) ? (1ULL << (q - 1)) << r : 0;
+    uint64_t n = rand64() % (qf.qf_max_size + 1);
+    vector<uint64_t> keys;
+    for (uint64_t i = 0; i < n; ++i) {
+      uint64_t hash = (rand64() & LOW_MASK(q + r)) | top;
+      if (qf_insert(&qf, hash)) {
+        keys.push_back(hash);
+      }
+    }
+
+    while (qf.qf_rbits > 1) {
+      assert(qf_expand(&qf));
+      struct quotient_filter ref;
+      if (!qf_init_flags(&ref, qf.qf_qbits, qf.qf_rbits, flags)) {
+        fail(&qf, "init-expand-ref");
+      }
+      for (size_t i = 0; i < keys.size(); ++i) {
+        assert(qf_insert(&ref, keys[i]));
+      }
+      same_table(&qf, &ref);
+      qf_destroy(&ref);
+    }
+    assert(!qf_expand(&qf));
+    assert(qf.qf_qbits == q + r - 1);
+    qf_destroy(&qf);
+  }
+}
+
+/*
+ * Shrink a QF one quotient bit at a time, and check each table against one
+ * built at that size from the same fingerprints. Once they no longer fit in
+ * half the slots, qf_shrink() must fail and leave the QF as it was.
+ */
+static void qf_test_shrink(uint32_t q, uint32_t r, uint32_t flags)
+{
+  for (uint32_t round = 0; round < ROUNDS_MAX / 100; ++round) {
+    struct quotient_filter qf;
+    if (!qf_init_flags(&qf, q, r, flags)) {
+      fail(&qf, "init-shrink");
+    }
+
+    /* Crowd some rounds into the last quotients, so that clusters wrap. */
+    uint64_t top = (round % 2) ? (1ULL << (q - 1)) << r : 0;
+    uint64_t n = rand64() % (qf.qf_max_size / (1 + round % 4) + 1);
+    set<uint64_t> fps;
+    for (uint64_t i = 0; i < n; ++i) {
+      uint64_t hash = (rand64() & LOW_MASK(q + r)) | top;
+      if (qf_insert(&qf, hash)) {
+        fps.insert(hash);
+      }
+    }
+
+    while (qf.qf_qbits > 1) {
+      /* A QF_NOWRAP tail may also run out of room. */
+      bool fits = fps.size() <= qf.qf_max_size / 2;
+      bool shrunk = qf_shrink(&qf);
+      assert(shrunk == fits || (!shrunk && (flags & QF_NOWRAP)));
+      assert(qf.qf_qbits + qf.qf_rbits == q + r);
+      assert(qf.qf_entries == fps.size());
+
+      set<uint64_t>::iterator it;
+      if (flags & QF_NOWRAP) {
+        for (it = fps.begin(); it != fps.end(); ++it) {
+          assert(qf_may_contain(&qf, *it));
+        }
+      } else {
+        struct quotient_filter ref;
+        if (!qf_init_flags(&ref, qf.qf_qbits, qf.qf_rbits, flags)) {
+          fail(&qf, "init-shrink-ref");
+        }
+        for (it = fps.begin(); it != fps.end(); ++it) {
+          assert(qf_insert(&ref, *it));
+        }
+        same_table(&qf, &ref);
+        qf_destroy(&ref);
+      }
+      if (!shrunk) {
+        break;
+      }
+    }
+    if (qf.qf_qbits == 1) {
+      assert(!qf_shrink(&qf));
+    }
+    qf_destroy(&qf);
+  }
+}
+
+/*
+ * Cut the remainders of a QF down to a random width, and check the table
+ * against one built at that width from the same hashes.
+ */
+static void qf_test_truncate(uint32_t q, uint32_t r, uint32_t flags)
+{
+  for (uint32_t round = 0; round < ROUNDS_MAX / 100; ++round) {
+    struct quotient_filter qf;
+    if (!qf_init_flags(&qf, q, r, flags)) {
+      fail(&qf, "init-truncate");
+    }
+
+    /* Crowd some rounds into the last quotients, so that clusters wrap. */
+    uint64_t top = (round % 2) ? (1ULL << (q - 1)) << r : 0;
+    uint64_t n = rand64() % (qf.qf_max_size + 1);
+    vector<uint64_t> keys;
+    for (uint64_t i = 0; i < n; ++i) {
+      uint64_t hash = rand64() | top;
+      if (qf_insert(&qf, hash)) {
+        keys.push_back(hash);
+      }
+    }
+
+    uint32_t new_r = 1 + rand() % r;
+    assert(!qf_truncate_remainders(&qf, 0));
+    assert(!qf_truncate_remainders(&qf, r + 1));
+    bool ok = qf_truncate_remainders(&qf, new_r);
+    assert(ok || (flags & QF_NOWRAP));
+    if (!ok) {
+      assert(qf.qf_rbits == r);
+      qf_destroy(&qf);
+      continue;
+    }
+    assert(qf.qf_qbits == q && qf.qf_rbits == new_r);
+
+    set<uint64_t> fps;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      assert(qf_may_contain(&qf, keys[i]));
+      fps.insert(keys[i] & LOW_MASK(q + new_r));
+    }
+    assert(qf.qf_entries == fps.size());
+    if (!(flags & QF_NOWRAP)) {
+      struct quotient_filter ref;
+      if (!qf_init_flags(&ref, q, new_r, flags)) {
+        fail(&qf, "init-truncate-ref");
+      }
+      for (size_t i = 0; i < keys.size(); ++i) {
+        assert(qf_insert(&ref, keys[i]));
+      }
+      same_table(&qf, &ref);
+      qf_destroy(&ref);
+    }
+    qf_destroy(&qf);
+  }
+}
+
+/*
+ * Mix inserts, lookups and removes into an incremental expansion, and check
+ * them against the set of fingerprints, then against qf_expand().
+ */
+static void qf_test_expand_begin(uint32_t q, uint32_t r, uint32_t flags)
+{
+  for (uint32_t round = 0; round < ROUNDS_MAX / 100; ++round) {
+    struct quotient_filter qf, ref;
+    if (!qf_init_flags(&qf, q, r, flags)) {
+      fail(&qf, "init-expand-begin");
+    }
+
+    /* Crowd some rounds into the last quotients, so that clusters wrap. */
+    uint64_t top = (round % 2) ? (1ULL << (q - 1)) << r : 0;
+    set<uint64_t> fps;
+    while (qf.qf_entries < qf.qf_max_size) {
+      uint64_t hash = (rand64() & LOW_MASK(q + r)) | top;
+      assert(qf_insert(&qf, hash));
+      fps.insert(hash);
+    }
+
+    assert(qf_expand_begin(&qf));
+    assert(!qf_expand_begin(&qf));
+    assert(qf.qf_qbits == q + 1 && qf.qf_entries == fps.size());
+    while (qf.qf_old) {
+      uint64_t hash = rand64() & LOW_MASK(q + r);
+      switch (rand() % 3) {
+      case 0:
+        assert(qf_insert(&qf, hash));
+        fps.insert(hash);
+        break;
+      case 1: {
+        assert(qf_may_contain(&qf, hash) || !fps.count(hash));
+        /* Batches look in both tables too. */
+        vector<uint64_t> batch(fps.lower_bound(hash), fps.end());
+        batch.resize(min<size_t>(batch.size(), 100));
+        vector<uint64_t> out(batch.size() / 64 + 1);
+        qf_may_contain_batch(&qf, batch.data(), batch.size(), out.data());
+        for (size_t i = 0; i < batch.size(); ++i) {
+          assert((out[i / 64] >> (i % 64)) & 1);
+        }
+        break;
+      }
+      default:
+        /* Remove a fingerprint which is in the filter. */
+        set<uint64_t>::iterator it = fps.lower_bound(hash);
+        if (it != fps.end()) {
+          assert(qf_remove(&qf, *it));
+          assert(!qf_may_contain(&qf, *it));
+          fps.erase(it);
+        }
+        break;
+      }
+      assert(qf.qf_entries == fps.size());
+    }
+
+    if (!qf_init_flags(&ref, q + 1, r - 1, flags)) {
+      fail(&qf, "init-expand-begin-ref");
+    }
+    set<uint64_t>::iterator it;
+    for (it = fps.begin(); it != fps.end(); ++it) {
+      assert(qf_insert(&ref, *it));
+    }
+    same_table(&qf, &ref);
+
+    /* Expansions may also be finished, or dropped, at once. */
+    if (qf.qf_rbits > 1) {
+      assert(qf_expand_begin(&qf));
+      if (round % 2) {
+        if (round % 4 == 3) {
+          /* Iterating moves what is left first, so it sees every entry. */
+          set<uint64_t> seen;
+          struct qf_iterator qfi;
+          qfi_start(&qf, &qfi);
+          while (!qfi_done(&qf, &qfi)) {
+            seen.insert(qfi_next(&qf, &qfi));
+          }
+          assert(seen == fps);
+        } else {
+          qf_expand_finish(&qf);
+        }
+        assert(!qf.qf_old && qf_expand(&ref));
+        same_table(&qf, &ref);
+      } else {
+        qf_clear(&qf);
+        assert(!qf.qf_old && qf.qf_entries == 0);
+      }
+    }
+    qf_destroy(&qf);
+    qf_destroy(&ref);
+  }
+
+  struct quotient_filter qf;
+  if (!qf_init_flags(&qf, q, r, flags | QF_NOWRAP)) {
+    fail(&qf, "init-expand-begin");
+  }
+  assert(!qf_expand_begin(&qf));
+  qf_destroy(&qf);
+}
+
+/* Count the growth events of a QF in the counter at arg. */
+static void count_grows(struct quotient_filter *qf, void *arg)
+{
+  assert(qf->qf_grow_arg == arg);
+  ++*(uint32_t *) arg;
+}
+
+/*
+ * Fill a QF with a qf_max_load up to many times its first size, until it has
+ * one remainder bit left. No insert may fail, the load factor must stay under
+ * the limit, and the table must end up the same as if it had been sized for
+ * its fingerprints from the start.
+ */
+static void qf_test_grow(uint32_t q, uint32_t r, uint32_t flags)
+{
+  struct quotient_filter qf, ref;
+  uint32_t events = 0;
+  if (!qf_init_flags(&qf, q, r, flags)) {
+    fail(&qf, "init-grow");
+  }
+  qf.qf_max_load = 0.85;
+  qf.qf_grow_policy = (q + r) % 2 ? QF_GROW_AT_ONCE : QF_GROW_INCREMENTAL;
+  qf.qf_on_grow = count_grows;
+  qf.qf_grow_arg = &events;
+
+  set<uint64_t> fps;
+  while (qf.qf_rbits > 1) {
+    uint64_t hash = rand64() & LOW_MASK(q + r);
+    /* An expansion is over before the next one has to start. */
+    uint32_t grows = qf.qf_grows;
+    bool expanding = qf.qf_old;
+    assert(qf_insert(&qf, hash));
+    assert(qf.qf_grows == grows || !expanding);
+    fps.insert(hash);
+    assert(qf.qf_entries == fps.size());
+    assert(qf.qf_entries <= qf.qf_max_load * qf.qf_max_size);
+  }
+  assert(qf.qf_grows == r - 1 && events == qf.qf_grows);
+
+  qf_expand_finish(&qf);
+  if (!qf_init_flags(&ref, q + r - 1, 1, flags)) {
+    fail(&qf, "init-grow-ref");
+  }
+  set<uint64_t>::iterator it;
+  for (it = fps.begin(); it != fps.end(); ++it) {
+    assert(qf_insert(&ref, *it));
+  }
+  same_table(&qf, &ref);
+  qf_destroy(&qf);
+  qf_destroy(&ref);
+}
+
+/* The fraction of n random hashes which a QF may contain. */
+static double false_positives(struct quotient_filter *qf, uint32_t n)
+{
+  uint32_t hits = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    hits += qf_may_contain(qf, rand64());
+  }
+  return (double) hits / n;
+}
+
+/*
+ * The functions which load, merge or split tables copy raw slots, and must
+ * refuse @qf, whose slots hold more than plain fingerprints. Check that they
+ * leave @qf, and any filter passed along with it, as they were.
+ */
+static void qf_refuses_copies(struct quotient_filter *qf, uint32_t flags)
+{
+  struct quotient_filter other, ref, out, lo, hi;
+  if (!qf_init_flags(&other, 2, 2, flags) ||
+      !qf_init_flags(&ref, 2, 2, flags)) {
+    fail(qf, "init-refuses-copies");
+  }
+  for (uint64_t hash = 1; hash < 16; hash += 5) {
+    assert(qf_insert(&other, hash) && qf_insert(&ref, hash));
+  }
+  uint64_t entries = qf->qf_entries;
+  vector<uint64_t> slots(table_slots(qf));
+  for (uint64_t idx = 0; idx < slots.size(); ++idx) {
+    slots[idx] = get_elem(qf, idx);
+  }
+
+  struct quotient_filter *qfs[2] = {&other, qf};
+  assert(!qf_merge(qf, &other, &out) && !qf_merge(&other, qf, &out));
+  assert(!qf_merge_many(qfs, 2, &out));
+  assert(!qf_merge_parallel(&other, qf, &out, 2));
+  assert(!qf_merge_into(qf, &other, &ref) && !qf_merge_into(&other, &ref, qf));
+  assert(!qf_union_into(&other, qf) && !qf_union_into(qf, &other));
+  assert(!qf_split(qf, &lo, &hi));
+
+  same_table(&ref, &other);
+  assert(qf->qf_entries == entries);
+  for (uint64_t idx = 0; idx < slots.size(); ++idx) {
+    assert(get_elem(qf, idx) == slots[idx]);
+  }
+  qf_destroy(&other);
+  qf_destroy(&ref);
+}
+
+/*
+ * Grow a QF_EXPANDABLE filter over and over, with inserts and removes in
+ * between and during the expansions. No key which is in the filter may go
+ * missing, and the false positive rate must stay near its first value.
+ */
+static void qf_test_expandable(uint32_t q, uint32_t r, uint32_t flags)
+{
+  const uint32_t EXPANSIONS = 8;
+  const uint32_t QUERIES = 1 << 14;
+  struct quotient_filter qf;
+  if (!qf_init_flags(&qf, q, r, flags | QF_EXPANDABLE)) {
+    fail(&qf, "init-expandable");
+  }
+
+  set<uint64_t> keys;
+  double fpr = 0;
+
+  for (uint32_t gen = 0; gen <= EXPANSIONS; ++gen) {
+    bool nowrap = flags & QF_NOWRAP;
+    if (gen > 0 && !nowrap && gen % 2) {
+      assert(qf_expand_begin(&qf));
+    } else if (gen > 0) {
+      assert(qf_expand(&qf));
+    }
+    assert(qf.qf_qbits == q + gen && qf.qf_rbits == r + gen);
+
+    while (qf.qf_entries < qf.qf_max_size / 2 || qf.qf_old) {
+      uint64_t hash = rand64();
+      if (rand() % 4) {
+        /* Some keys share their top q+r-1 bits, and so their entry. */
+        set<uint64_t>::iterator near = keys.lower_bound(hash);
+        if (rand() % 8 == 0 && near != keys.end()) {
+          hash = *near ^ 1;
+        }
+        if (!keys.count(hash) && qf_insert(&qf, hash)) {
+          keys.insert(hash);
+        } else {
+          assert(nowrap || keys.count(hash));
+        }
+        continue;
+      }
+      set<uint64_t>::iterator it = keys.lower_bound(hash);
+      if (it != keys.end()) {
+        assert(qf_remove(&qf, *it));
+        keys.erase(it);
+      }
+    }
+
+    if (!nowrap) {
+      qf_consistent(&qf);
+    }
+    set<uint64_t>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+      assert(qf_may_contain(&qf, *it));
+    }
+
+    double rate = false_positives(&qf, QUERIES);
+    if (gen == 0) {
+      fpr = rate;
+    }
+    assert(rate <= 2 * fpr + 0.02);
+  }
+  qf_refuses_copies(&qf, flags);
+
+  /* Removing one of two hashes which share an entry keeps the other. */
+  qf_clear(&qf);
+  uint64_t a = rand64();
+  assert(qf_insert(&qf, a) && qf_insert(&qf, a ^ 1) && qf.qf_entries == 2);
+  assert(qf_remove(&qf, a) && qf_may_contain(&qf, a ^ 1));
+  assert(qf_remove(&qf, a ^ 1) && qf.qf_entries == 0);
+  qf_destroy(&qf);
+
+  /*
+   * The entries of an r = 2 filter run out of fingerprint bits when it
+   * expands, and then take two slots each when it expands again. Inserts
+   * during that expansion must leave room for them, or entries go missing.
+   */
+  if (!(flags & QF_NOWRAP)) {
+    if (!qf_init_flags(&qf, q, 2, flags | QF_EXPANDABLE)) {
+      fail(&qf, "init-expandable");
+    }
+    keys.clear();
+    for (uint32_t gen = 0; gen < 2; ++gen) {
+      while (qf.qf_entries < qf.qf_max_size) {
+        uint64_t hash = rand64();
+        assert(qf_insert(&qf, hash));
+        keys.insert(hash);
+      }
+      assert(gen ? qf_expand_begin(&qf) : qf_expand(&qf));
+    }
+    for (uint64_t i = 0; i < 2 * qf.qf_max_size; ++i) {
+      uint64_t hash = rand64();
+      if (qf_insert(&qf, hash)) {
+        keys.insert(hash);
+      }
+      uint64_t old = qf.qf_old ? qf.qf_old->qf_entries : 0;
+      assert(qf.qf_entries + old <= qf.qf_max_size);
+    }
+    qf_expand_finish(&qf);
+    qf_consistent(&qf);
+    set<uint64_t>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+      assert(qf_may_contain(&qf, *it));
+    }
+    qf_destroy(&qf);
+  }
+
+  /* Expansions stop once the hash runs out of bits. */
+  if (!qf_init_flags(&qf, 3, 60, flags | QF_EXPANDABLE)) {
+    fail(&qf, "init-expandable");
+  }
+  assert(!qf_expand(&qf));
+  uint64_t hash = rand64();
+  assert(!qf_bulk_load(&qf, &hash, 1) && !qf_bulk_build(&qf, &hash, 1, 1));
+  assert(qf.qf_entries == 0);
+  qf_destroy(&qf);
+  assert(!qf_init_flags(&qf, q, 1, flags | QF_EXPANDABLE));
+}
+
+/*
+ * Decode the runs of a QF_COUNTING filter into the copies of each
+ * fingerprint, checking that each run holds its remainders in order, each
+ * encoded the one way it should be, and that they add up to qf_entries.
+ */
+static map<uint64_t, uint64_t> count_table(struct quotient_filter *qf)
+{
+  map<uint64_t, uint64_t> counts;
+  uint64_t slots = 0;
+
+  for (uint64_t fq = 0; fq < qf->qf_max_size; ++fq) {
+    if (!slot_occupied(qf, fq)) {
+      continue;
+    }
+    uint64_t s = find_run_index(qf, fq);
+    bool first = true;
+    uint64_t prev = 0;
+    do {
+      uint64_t rem, count;
+      uint64_t last = count_decode(qf, s, &rem, &count);
+      assert(first || rem > prev);
+      first = false;
+      prev = rem;
+
+      uint64_t out[COUNT_MAX_SLOTS];
+      int n = count_encode(qf, rem, count, out);
+      for (int i = 0; i < n; ++i, s = incr(qf, s)) {
+        assert(get_remainder(get_elem(qf, s)) == out[i]);
+      }
+      assert(decr(qf, s) == last);
+      slots += n;
+      counts[(fq << qf->qf_rbits) | rem] = count;
+    } while (is_continuation(get_elem(qf, s)));
+  }
+  assert(slots == qf->qf_entries);
+  return counts;
+}
+
+/*
+ * Insert and remove a skewed stream of hashes into a QF_COUNTING filter, and
+ * check the copies it counts against those of each fingerprint.
+ */
+static void qf_test_counting(uint32_t q, uint32_t r, uint32_t flags)
+{
+  struct quotient_filter qf;
+  if (!qf_init_flags(&qf, q, r, flags | QF_COUNTING)) {
+    fail(&qf, "init-counting");
+  }
+  uint64_t fmask = LOW_MASK(q + r);
+  bool nowrap = flags & QF_NOWRAP;
+
+  /* Walk a remainder through many counts, next to neighbours in its run. */
+  uint64_t rems[] = {0, 1, qf.qf_rmask / 2, qf.qf_rmask - 1, qf.qf_rmask};
+  for (size_t i = 0; i < sizeof(rems) / sizeof(rems[0]); ++i) {
+    uint64_t fq = rand64() & qf.qf_index_mask;
+    uint64_t hash = (fq << r) | rems[i];
+    uint64_t lo = (fq << r) | (rems[i] ? rems[i] - 1 : qf.qf_rmask);
+    uint64_t hi = (fq << r) | ((rems[i] + 1) & qf.qf_rmask);
+    assert(qf_insert(&qf, lo) && qf_insert(&qf, hi) && qf_insert(&qf, hi));
+    uint64_t n = min<uint64_t>(300, qf.qf_max_size);
+    uint64_t c;
+    for (c = 1; c <= n && qf_insert(&qf, hash | (c << 62)); ++c) {
+      assert(qf_count(&qf, hash) == c);
+      assert(qf_count(&qf, lo) == 1 && qf_count(&qf, hi) == 2);
+    }
+    /* Only a copy which needs another slot may be refused. */
+    uint64_t out[COUNT_MAX_SLOTS];
+    assert(c > n || count_encode(&qf, rems[i], c, out) >
+        count_encode(&qf, rems[i], c - 1, out));
+    assert(c > n || nowrap || qf.qf_entries == qf.qf_max_size);
+    count_table(&qf);
+    while (--c) {
+      assert(qf_remove(&qf, hash | (c << 62)));
+      assert(qf_count(&qf, hash) == c - 1);
+      assert(qf_count(&qf, lo) == 1 && qf_count(&qf, hi) == 2);
+    }
+    assert(!qf_may_contain(&qf, hash));
+    assert(qf_remove(&qf, lo) && qf_remove(&qf, hi) && qf_remove(&qf, hi));
+    assert(qf.qf_entries == 0);
+    qf_consistent(&qf);
+  }
+
+  /* Draw from a pool of keys, favouring the first ones. */
+  vector<uint64_t> pool(qf.qf_max_size / 2 + 1);
+  for (size_t i = 0; i < pool.size(); ++i) {
+    pool[i] = rand64();
+    if (i % 3 == 0) {
+      pool[i] &= ~qf.qf_rmask;
+    }
+  }
+  map<uint64_t, uint64_t> model;
+  for (uint32_t round = 0; round < ROUNDS_MAX; ++round) {
+    uint64_t hash = pool[rand() % (1 + rand() % pool.size())];
+    if (rand() % 3) {
+      if (qf_insert(&qf, hash)) {
+        ++model[hash & fmask];
+      } else {
+        map<uint64_t, uint64_t>::iterator it = model.find(hash & fmask);
+        uint64_t x = hash & qf.qf_rmask;
+        uint64_t out[COUNT_MAX_SLOTS];
+        assert(it == model.end() || count_encode(&qf, x, it->second + 1,
+              out) > count_encode(&qf, x, it->second, out));
+        assert(nowrap || qf.qf_entries == qf.qf_max_size);
+      }
+    } else {
+      assert(qf_remove(&qf, hash));
+      map<uint64_t, uint64_t>::iterator it = model.find(hash & fmask);
+      if (it != model.end() && --it->second == 0) {
+        model.erase(it);
+      }
+    }
+    if (round % 50 == 0) {
+      assert(count_table(&qf) == model);
+    }
+    map<uint64_t, uint64_t>::iterator it = model.find(hash & fmask);
+    assert(qf_count(&qf, hash) == (it == model.end() ? 0 : it->second));
+  }
+  assert(count_table(&qf) == model);
+  if (!nowrap) {
+    qf_consistent(&qf);
+  }
+
+  /* Removing one of two hashes with a fingerprint keeps the other. */
+  qf_clear(&qf);
+  uint64_t a = rand64() | (1ULL << 63);
+  uint64_t b = a & ~(1ULL << 63);
+  assert(qf_insert(&qf, a) && qf_insert(&qf, b));
+  assert(qf_remove(&qf, a));
+  assert(qf_may_contain(&qf, b) && qf_count(&qf, b) == 1);
+
+  /* A full QF still counts a copy which fits in the slots it has. */
+  qf_clear(&qf);
+  a |= qf.qf_rmask; /* Its 4th copy takes no counter prefix. */
+  assert(qf_insert(&qf, a) && qf_insert(&qf, a) && qf_insert(&qf, a));
+  while (qf.qf_entries < qf.qf_max_size) {
+    uint64_t hash = rand64();
+    if ((hash & fmask) != (a & fmask) && !qf_insert(&qf, hash)) {
+      break;
+    }
+  }
+  assert(qf_count(&qf, a) == 3 && qf_insert(&qf, a));
+  assert(qf_count(&qf, a) == 4);
+  assert(qf_remove(&qf, a) && qf_remove(&qf, a) && qf_remove(&qf, a));
+
+  /* Counters don't survive resizing, or copies of the raw slots. */
+  assert(!qf_expand(&qf) && !qf_expand_begin(&qf) && !qf_shrink(&qf));
+  assert(!qf_truncate_remainders(&qf, r - 1));
+  assert(qf_insert(&qf, a) && qf_insert(&qf, a) && qf_count(&qf, a) == 3);
+  qf_refuses_copies(&qf, flags);
+  assert(qf_count(&qf, a) == 3);
+  qf_clear(&qf);
+  assert(!qf_bulk_load(&qf, &a, 1) && !qf_bulk_build(&qf, &a, 1, 1));
+  assert(qf.qf_entries == 0);
+  qf_destroy(&qf);
+  assert(!qf_init_flags(&qf, q, 1, flags | QF_COUNTING));
+  assert(!qf_init_flags(&qf, q, r, flags | QF_COUNTING | QF_EXPANDABLE));
+}
+
+/* The BMI2 and portable run searches must agree on every run. */
+static void qf_test_dispatch()
+{
+  const uint32_t q = 10;
+  const uint32_t widths[] = {10, 13};
+  const uint32_t flags[] = {0, QF_BLOCKED, QF_PLANES, QF_NOWRAP};
+
+  if (!cpu_bmi2) {
+    return;
+  }
+  for (uint32_t i = 0; i < 2; ++i) {
+    for (uint32_t j = 0; j < 4; ++j) {
+      struct quotient_filter qf;
+      uint32_t r = widths[i];
+      if (!qf_init_flags(&qf, q, r, flags[j])) {
+        fail(&qf, "init-dispatch");
+      }
+      while (qf.qf_entries < 19 * qf.qf_max_size / 20 &&
+          qf_insert(&qf, rand64() & LOW_MASK(q + r))) {
+      }
+      for (uint64_t fq = 0; fq < qf.qf_max_size; ++fq) {
+        if (!slot_occupied(&qf, fq)) {
+          continue;
+        }
+        cpu_bmi2 = false;
+        uint64_t s = find_run_index(&qf, fq);
+        cpu_bmi2 = true;
+        if (find_run_index(&qf, fq) != s) {
+          fail(&qf, "dispatch");
+        }
+      }
+      qf_destroy(&qf);
+    }
+  }
+}
+
+/* Fill up the QF (at least partially). */
+static void random_fill(struct quotient_filter *qf)
+{
+  set<uint64_t> keys;
+  uint64_t elts = ((uint64_t) rand()) % qf->qf_max_size;
+  while (elts) {
+    ht_put(qf, keys);
+    --elts;
+  }
+  qf_consistent(qf);
+}
+
+/* Check if @lhs is a subset of @rhs. */
+static void subsetof(struct quotient_filter *lhs, struct quotient_filter *rhs)
+{
+  struct qf_iterator qfi;
+  qfi_start(lhs, &qfi);
+  while (!qfi_done(lhs, &qfi)) {
+    uint64_t hash = qfi_next(lhs, &qfi);
+    assert(qf_may_contain(rhs, hash));
+  }
+}
+
+/* Collect the fingerprints of @qf, cut down to their lowest @bits bits. */
+static void fingerprints(struct quotient_filter *qf, uint32_t bits,
+    set<uint64_t> &fps)
+{
+  struct qf_iterator qfi;
+  qfi_start(qf, &qfi);
+  while (!qfi_done(qf, &qfi)) {
+    fps.insert(qfi_next(qf, &qfi) & LOW_MASK(bits));
+  }
+}
+
+/*
+ * Check that @qf holds exactly the fingerprints of @qf1 and @qf2, cut down to
+ * its q+r bits.
+ */
+static void supersetof(struct quotient_filter *qf, struct quotient_filter *qf1,
+    struct quotient_filter *qf2)
+{
+  set<uint64_t> fps;
+  fingerprints(qf1, qf->qf_qbits + qf->qf_rbits, fps);
+  fingerprints(qf2, qf->qf_qbits + qf->qf_rbits, fps);
+
+  struct qf_iterator qfi;
+  qfi_start(qf, &qfi);
+  set<uint64_t>::iterator it;
+  for (it = fps.begin(); it != fps.end(); ++it) {
+    assert(!qfi_done(qf, &qfi));
+    assert(qfi_next(qf, &qfi) == *it);
+  }
+  assert(qfi_done(qf, &qfi));
+}
+
+/*
+ * Merge a random number of filters of random shapes with qf_merge_many(). The
+ * output keeps the narrowest input's q+r bits.
+ */
+static void qf_test_merge_many(uint32_t flags)
+{
+  for (uint32_t round = 0; round < ROUNDS_MAX / 20; ++round) {
+    size_t k = 1 + rand() % 20;
+    uint32_t bits = 8 + rand() % 10;
+    uint32_t w = 64;
+    vector<struct quotient_filter> qfs(k);
+    vector<struct quotient_filter *> ptrs(k);
+    for (size_t i = 0; i < k; ++i) {
+      uint32_t q = 1 + rand() % min(Q_MAX, bits - 1);
+      uint32_t r = bits - q + rand() % 3;
+      if (!qf_init_flags(&qfs[i], q, r, flags)) {
+        fail(&qfs[i], "init-merge-many");
+      }
+      ptrs[i] = &qfs[i];
+      random_fill(&qfs[i]);
+      w = min(w, q + r);
+    }
+
+    set<uint64_t> fps;
+    for (size_t i = 0; i < k; ++i) {
+      fingerprints(&qfs[i], w, fps);
+    }
+
+    struct quotient_filter qf, ref;
+    if (!qf_merge_many(&ptrs[0], k, &qf)) {
+      /* Only a union which overflows the widest possible q may fail. */
+      assert(fps.size() > (1ULL << (w - 1)));
+    } else {
+      assert(qf.qf_qbits + qf.qf_rbits == w);
+      if (!qf_init_flags(&ref, qf.qf_qbits, qf.qf_rbits, flags)) {
+        fail(&qf, "init-merge-many-ref");
+      }
+      set<uint64_t>::iterator it;
+      for (it = fps.begin(); it != fps.end(); ++it) {
+        assert(qf_insert(&ref, *it));
+      }
+      same_table(&qf, &ref);
+      qf_destroy(&qf);
+      qf_destroy(&ref);
+    }
+
+    for (size_t i = 0; i < k; ++i) {
+      qf_destroy(&qfs[i]);
+    }
+  }
+}
+
+/* qf_merge_parallel() must build the same table as qf_merge(). */
+static void qf_test_merge_parallel(uint32_t flags)
+{
+  for (uint32_t round = 0; round < ROUNDS_MAX / 20; ++round) {
+    uint32_t q = 6 + rand() % 9;
+    uint32_t r = 1 + rand() % 12;
+    struct quotient_filter qf1, qf2, seq, par;
+    if (!qf_init_flags(&qf1, q, r, flags) ||
+        !qf_init_flags(&qf2, q, r, flags)) {
+      fail(&qf1, "init-merge-parallel");
+    }
+
+    /* Crowd some rounds into the last quotients, so that clusters wrap. */
+    uint64_t top = (round % 2) ? (1ULL << (q - 1)) << r : 0;
+    uint64_t n = rand64() % (3 * qf1.qf_max_size / 4 + 1);
+    for (uint64_t i = 0; i < n; ++i) {
+      uint64_t hash = (rand64() & LOW_MASK(q + r)) | top;
+      qf_insert(i % 2 ? &qf1 : &qf2, hash);
+      if (rand() % 4 == 0) {
+        qf_insert(i % 2 ? &qf2 : &qf1, hash);
+      }
+    }
+
+    bool ok = qf_merge(&qf1, &qf2, &seq);
+    assert(qf_merge_parallel(&qf1, &qf2, &par, 2 + rand() % 7) == ok);
+    if (ok) {
+      same_table(&par, &seq);
+      qf_destroy(&seq);
+      qf_destroy(&par);
+    }
+    qf_destroy(&qf1);
+    qf_destroy(&qf2);
+  }
+}
+
+static uint64_t usecs(struct timeval *tv1, struct timeval *tv2)
+{
+  return (tv2->tv_sec - tv1->tv_sec) * 1000000ULL + tv2->tv_usec -
+    tv1->tv_usec;
+}
+
+/* Benchmarked lookup results land here, so they are not optimized away. */
+static volatile uint64_t bench_hits;
+
+/* A well-mixed 64-bit hash of i (splitmix64), since rand() has 31 bits. */
+static uint64_t mix64(uint64_t i)
+{
+  uint64_t z = i + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* Time inserts + lookups for a filter, returning the elapsed microseconds. */
+static uint64_t bench_ops(struct quotient_filter *qf, uint32_t ninserts,
+    uint32_t nlookups)
+{
+  struct timeval tv1, tv2;
+  gettimeofday(&tv1, NULL);
+  for (uint64_t i = 0; qf->qf_entries < ninserts; ++i) {
+    qf_insert(qf, mix64(i));
+  }
+  for (uint32_t i = 0; i < nlookups; ++i) {
+    bench_hits += qf_may_contain(qf, mix64(~(uint64_t) i));
+  }
+  gettimeofday(&tv2, NULL);
+  return usecs(&tv1, &tv2);
+}
+
+/* Compare the byte-aligned slot accessors against the generic packed ones. */
+static void qf_bench_widths()
+{
+  const uint32_t q = 22;
+  const uint32_t widths[] = {5, 13, 29};
+  const uint32_t ninserts = 3 * (1 << q) / 4;
+  const uint32_t nlookups = 4000000;
+
+  for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); ++i) {
+    struct quotient_filter qf;
+    uint32_t r = widths[i];
+    uint64_t t[2];
+
+    for (int generic = 0; generic < 2; ++generic) {
+      assert(qf_init(&qf, q, r));
+      if (generic) {
+        qf.qf_store = STORE_PACKED;
+      }
+      t[generic] = bench_ops(&qf, ninserts, nlookups);
+      qf_destroy(&qf);
+    }
+
+    printf("%u-bit slots (r=%u): %llu ms aligned, %llu ms packed, "
+        "%.2fx speedup\n", r + 3, r, t[0] / 1000, t[1] / 1000,
+        double(t[1]) / double(t[0]));
+    fflush(stdout);
+  }
+}
+
+/* Compare QuotientFilter<Q, R> against the runtime-parameterized filter. */
+template <uint32_t Q, uint32_t R>
+static void qf_bench_template()
+{
+  const uint32_t ninserts = 3 * (1 << Q) / 4;
+  const uint32_t nlookups = 4000000;
+  struct quotient_filter qf;
+  struct timeval tv1, tv2;
+
+  assert(qf_init_flags(&qf, Q, R, 0));
+  uint64_t tc = bench_ops(&qf, ninserts, nlookups);
+  qf_destroy(&qf);
+
+  QuotientFilter<Q, R> *tqf = new QuotientFilter<Q, R>;
+  gettimeofday(&tv1, NULL);
+  for (uint64_t i = 0; tqf->entries() < ninserts; ++i) {
+    tqf->insert(mix64(i));
+  }
+  for (uint32_t i = 0; i < nlookups; ++i) {
+    bench_hits += tqf->may_contain(mix64(~(uint64_t) i));
+  }
+  gettimeofday(&tv2, NULL);
+  uint64_t tt = usecs(&tv1, &tv2);
+  delete tqf;
+
+  printf("QuotientFilter<%u, %u>: %llu ms template, %llu ms qf.c, "
+      "%.2fx speedup\n", Q, R, tt / 1000, tc / 1000,
+      double(tc) / double(tt));
+  fflush(stdout);
+}
+
+/* Compare startup, insert and lookup times with and without huge pages. */
+static void qf_bench_hugepages()
+{
+  const uint32_t q = 28;
+  const uint32_t r = 5;
+  const uint32_t ninserts = 3 * (1 << q) / 4;
+  const uint32_t nlookups = 10000000;
+  const struct {
+    const char *name;
+    uint32_t flags;
+  } configs[] = {
+    {"calloc", 0},
+    {"prefault", QF_PREFAULT},
+    {"hugepages", QF_HUGEPAGES},
+    {"hugepages+prefault", QF_HUGEPAGES | QF_PREFAULT},
+  };
+
+  for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i) {
+    struct quotient_filter qf;
+    struct timeval tv1, tv2, tv3, tv4;
+
+    gettimeofday(&tv1, NULL);
+    assert(qf_init_flags(&qf, q, r, configs[i].flags));
+    gettimeofday(&tv2, NULL);
+    for (uint64_t j = 0; qf.qf_entries < ninserts; ++j) {
+      qf_insert(&qf, mix64(j));
+    }
+    gettimeofday(&tv3, NULL);
+    for (uint32_t j = 0; j < nlookups; ++j) {
+      bench_hits += qf_may_contain(&qf, mix64(~(uint64_t) j));
+    }
+    gettimeofday(&tv4, NULL);
+    qf_destroy(&qf);
+
+    printf("q=%u %s: init %llu ms, %.2f Minserts/s, %.2f Mlookups/s\n", q,
+        configs[i].name, usecs(&tv1, &tv2) / 1000,
+        double(ninserts) / usecs(&tv2, &tv3),
+        double(nlookups) / usecs(&tv3, &tv4));
+    fflush(stdout);
+  }
+}
+
+/* Time remove/insert pairs on a 90% full table, which shift long clusters. */
+static void qf_bench_churn()
+{
+  const uint32_t q = 20;
+  const uint32_t nfill = 9 * (1 << q) / 10;
+  const uint32_t nops = 2000000;
+  const struct {
+    const char *name;
+    uint32_t r;
+    uint32_t flags;
+  } configs[] = {
+    {"packed", 10, 0},
+    {"aligned", 13, 0},
+    {"blocked", 10, QF_BLOCKED},
+    {"planes", 10, QF_PLANES},
+  };
+
+  for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i) {
+    struct quotient_filter qf;
+    struct timeval tv1, tv2;
+    uint64_t mask = LOW_MASK(q + configs[i].r);
+
+    assert(qf_init_flags(&qf, q, configs[i].r, configs[i].flags));
+    for (uint32_t j = 0; j < nfill; ++j) {
+      qf_insert(&qf, mix64(j) & mask);
+    }
+    gettimeofday(&tv1, NULL);
+    for (uint32_t j = 0; j < nops; ++j) {
+      qf_remove(&qf, mix64(j) & mask);
+      qf_insert(&qf, mix64(j + nfill) & mask);
+    }
+    gettimeofday(&tv2, NULL);
+    qf_destroy(&qf);
+
+    printf("90%% load %s (r=%u): %.0f ns per remove + insert\n",
+        configs[i].name, configs[i].r, 1000.0 * usecs(&tv1, &tv2) / nops);
+    fflush(stdout);
+  }
+}
+
+/*
+ * Insert a skewed stream of keys, where a few keys make up most of the
+ * inserts, into a QF_COUNTING filter and a plain one. Report the slots the
+ * counters take, and the time per insert and per qf_count().
+ */
+static void qf_bench_counting()
+{
+  const uint32_t q = 20;
+  const uint32_t r = 10;
+  const uint64_t keys = 1 << 17;
+  const uint32_t n = 8000000;
+  const uint32_t flags[] = {QF_COUNTING, 0};
+
+  for (uint32_t i = 0; i < 2; ++i) {
+    struct quotient_filter qf;
+    struct timeval tv1, tv2, tv3;
+
+    assert(qf_init_flags(&qf, q, r, flags[i]));
+    gettimeofday(&tv1, NULL);
+    for (uint32_t j = 0; j < n; ++j) {
+      /* Key k comes up about k^(-2/3) times as often as key 1. */
+      uint64_t x = mix64(j) % keys;
+      qf_insert(&qf, mix64(x * x / keys * x / keys));
+    }
+    gettimeofday(&tv2, NULL);
+    uint64_t total = 0;
+    for (uint64_t k = 0; k < keys; ++k) {
+      total += qf_count(&qf, mix64(k));
+    }
+    gettimeofday(&tv3, NULL);
+
+    printf("%u skewed inserts %s: %llu slots, %.0f ns per insert, "
+        "%.0f ns per qf_count, %llu counted\n", n,
+        i ? "without counters" : "with QF_COUNTING",
+        (unsigned long long) qf.qf_entries,
+        1000.0 * usecs(&tv1, &tv2) / n, 1000.0 * usecs(&tv2, &tv3) / keys,
+        total);
+    fflush(stdout);
+    qf_destroy(&qf);
+  }
+}
+
+/* Compare building a 90% full filter with qf_insert() and in bulk. */
+static void qf_bench_bulk_load()
+{
+  const uint32_t q = 24;
+  const uint32_t n = 9 * (1 << q) / 10;
+  const struct {
+    const char *name;
+    uint32_t r;
+    uint32_t flags;
+  } configs[] = {
+    {"packed", 10, 0},
+    {"aligned", 13, 0},
+    {"blocked", 10, QF_BLOCKED},
+    {"planes", 10, QF_PLANES},
+  };
+
+  for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i) {
+    struct quotient_filter qf;
+    struct timeval tv1, tv2, tv3, tv4;
+    uint64_t mask = LOW_MASK(q + configs[i].r);
+    vector<uint64_t> hashes(n);
+    for (uint32_t j = 0; j < n; ++j) {
+      hashes[j] = mix64(j) & mask;
+    }
+
+    assert(qf_init_flags(&qf, q, configs[i].r, configs[i].flags));
+    gettimeofday(&tv1, NULL);
+    for (uint32_t j = 0; j < n; ++j) {
+      qf_insert(&qf, hashes[j]);
+    }
+    gettimeofday(&tv2, NULL);
+    qf_clear(&qf);
+    sort(hashes.begin(), hashes.end());
+    gettimeofday(&tv3, NULL);
+    assert(qf_bulk_load(&qf, hashes.data(), n));
+    gettimeofday(&tv4, NULL);
+
+    printf("q=%u %s: qf_insert %llu ms, sort %llu ms, qf_bulk_load %llu ms\n",
+        q, configs[i].name, usecs(&tv1, &tv2) / 1000,
+        usecs(&tv2, &tv3) / 1000, usecs(&tv3, &tv4) / 1000);
+
+    /* qf_bulk_build() sorts the unsorted hashes itself. */
+    for (uint32_t nthreads = 1; nthreads <= 8; nthreads *= 2) {
+      for (uint32_t j = 0; j < n; ++j) {
+        hashes[j] = mix64(j);
+      }
+      qf_clear(&qf);
+      gettimeofday(&tv1, NULL);
+      assert(qf_bulk_build(&qf, hashes.data(), n, nthreads));
+      gettimeofday(&tv2, NULL);
+      printf("  qf_bulk_build, %u threads: %llu ms\n", nthreads,
+          usecs(&tv1, &tv2) / 1000);
+    }
+    qf_destroy(&qf);
+    fflush(stdout);
+  }
+}
+
+/* Compare qf_merge() against inserting both inputs' fingerprints one by one. */
+static void qf_bench_merge()
+{
+  const uint32_t q = 22;
+  const uint32_t r = 10;
+  const uint32_t flags[] = {0, QF_BLOCKED, QF_PLANES};
+  const char *names[] = {"packed", "blocked", "planes"};
+
+  for (uint32_t i = 0; i < 3; ++i) {
+    struct quotient_filter qf1, qf2, qfout;
+    struct qf_iterator qfi;
+    struct timeval tv1, tv2, tv3;
+
+    assert(qf_init_flags(&qf1, q, r, flags[i]));
+    assert(qf_init_flags(&qf2, q, r, flags[i]));
+    for (uint32_t j = 0; j < 9 * (1 << q) / 10; ++j) {
+      qf_insert(j % 2 ? &qf1 : &qf2, mix64(j));
+    }
+
+    gettimeofday(&tv1, NULL);
+    assert(qf_init_flags(&qfout, q + 1, r, flags[i]));
+    qfi_start(&qf1, &qfi);
+    while (!qfi_done(&qf1, &qfi)) {
+      qf_insert(&qfout, qfi_next(&qf1, &qfi));
+    }
+    qfi_start(&qf2, &qfi);
+    while (!qfi_done(&qf2, &qfi)) {
+      qf_insert(&qfout, qfi_next(&qf2, &qfi));
+    }
+    gettimeofday(&tv2, NULL);
+    qf_destroy(&qfout);
+    assert(qf_merge(&qf1, &qf2, &qfout));
+    gettimeofday(&tv3, NULL);
+
+    printf("q=%u %s: qf_insert merge %llu ms, qf_merge %llu ms\n", q,
+        names[i], usecs(&tv1, &tv2) / 1000, usecs(&tv2, &tv3) / 1000);
+    qf_destroy(&qfout);
+
+    for (uint32_t nthreads = 2; nthreads <= 8; nthreads *= 2) {
+      gettimeofday(&tv1, NULL);
+      assert(qf_merge_parallel(&qf1, &qf2, &qfout, nthreads));
+      gettimeofday(&tv2, NULL);
+      printf("  qf_merge_parallel, %u threads: %llu ms\n", nthreads,
+          usecs(&tv1, &tv2) / 1000);
+      qf_destroy(&qfout);
+    }
+    fflush(stdout);
+    qf_destroy(&qf1);
+    qf_destroy(&qf2);
+  }
+}
+
+/* Compare a tree of pairwise qf_merge() calls with one qf_merge_many(). */
+static void qf_bench_merge_many()
+{
+  const uint32_t q = 18;
+  const uint32_t r = 10;
+  const size_t k = 16;
+  struct quotient_filter qfs[2 * k - 1];
+  struct quotient_filter *ptrs[k];
+  struct timeval tv1, tv2, tv3;
+
+  for (size_t i = 0; i < k; ++i) {
+    assert(qf_init(&qfs[i], q, r));
+    for (uint32_t j = 0; j < 9 * (1 << q) / 10; ++j) {
+      qf_insert(&qfs[i], mix64((i << 32) | j));
+    }
+    ptrs[i] = &qfs[i];
+  }
+
+  gettimeofday(&tv1, NULL);
+  for (size_t i = 0; i < k - 1; ++i) {
+    assert(qf_merge(&qfs[2 * i], &qfs[2 * i + 1], &qfs[k + i]));
+  }
+  gettimeofday(&tv2, NULL);
+  struct quotient_filter qf;
+  assert(qf_merge_many(ptrs, k, &qf));
+  gettimeofday(&tv3, NULL);
+
+  printf("%zu filters, q=%u: pairwise qf_merge %llu ms (q=%u), "
+      "qf_merge_many %llu ms (q=%u)\n", k, q, usecs(&tv1, &tv2) / 1000,
+      qfs[2 * k - 2].qf_qbits, usecs(&tv2, &tv3) / 1000, qf.qf_qbits);
+  fflush(stdout);
+  qf_destroy(&qf);
+  for (size_t i = 0; i < 2 * k - 1; ++i) {
+    qf_destroy(&qfs[i]);
+  }
+}
+
+/* Fold a small delta filter into a large one, in place and by qf_merge(). */
+static void qf_bench_union_into()
+{
+  const uint32_t q = 22;
+  const uint32_t r = 10;
+  struct quotient_filter base, delta, qf;
+  struct timeval tv1, tv2, tv3, tv4;
+
+  assert(qf_init(&base, q, r));
+  assert(qf_init(&delta, q - 6, r + 6));
+  for (uint32_t j = 0; j < 6 * (1 << q) / 10; ++j) {
+    qf_insert(&base, mix64(j));
+  }
+  for (uint32_t j = 0; j < 3 * (1 << (q - 6)) / 4; ++j) {
+    qf_insert(&delta, mix64(~j));
+  }
+
+  gettimeofday(&tv1, NULL);
+  assert(qf_merge(&base, &delta, &qf));
+  gettimeofday(&tv2, NULL);
+  struct qf_iterator qfi;
+  qfi_start(&delta, &qfi);
+  while (!qfi_done(&delta, &qfi)) {
+    qf_insert(&base, qfi_next(&delta, &qfi));
+  }
+  gettimeofday(&tv3, NULL);
+  printf("q=%u base, %llu delta entries: qf_merge %llu ms, qf_insert %llu ms\n",
+      q, (unsigned long long) delta.qf_entries, usecs(&tv1, &tv2) / 1000,
+      usecs(&tv2, &tv3) / 1000);
+
+  qf_clear(&base);
+  for (uint32_t j = 0; j < 6 * (1 << q) / 10; ++j) {
+    qf_insert(&base, mix64(j));
+  }
+  gettimeofday(&tv3, NULL);
+  assert(qf_union_into(&base, &delta));
+  gettimeofday(&tv4, NULL);
+  printf("  qf_union_into %llu ms\n", usecs(&tv3, &tv4) / 1000);
+  fflush(stdout);
+  qf_destroy(&qf);
+  qf_destroy(&base);
+  qf_destroy(&delta);
+}
+
+/* Compare qf_expand() with re-inserting every hash into a doubled filter. */
+static void qf_bench_expand()
+{
+  const uint32_t q = 22;
+  const uint32_t r = 10;
+  const uint32_t n = 9 * (1 << q) / 10;
+  struct quotient_filter qf, big;
+  struct timeval tv1, tv2, tv3, tv4;
+
+  assert(qf_init(&qf, q, r));
+  for (uint32_t j = 0; j < n; ++j) {
+    qf_insert(&qf, mix64(j));
+  }
+
+  gettimeofday(&tv1, NULL);
+  assert(qf_init(&big, q + 1, r - 1));
+  for (uint32_t j = 0; j < n; ++j) {
+    qf_insert(&big, mix64(j));
+  }
+  gettimeofday(&tv2, NULL);
+  assert(qf_expand(&qf));
+  gettimeofday(&tv3, NULL);
+  assert(qf_shrink(&qf));
+  gettimeofday(&tv4, NULL);
+
+  printf("q=%u: qf_insert into q=%u %llu ms, qf_expand %llu ms, "
+      "qf_shrink back %llu ms\n", q, q + 1, usecs(&tv1, &tv2) / 1000,
+      usecs(&tv2, &tv3) / 1000, usecs(&tv3, &tv4) / 1000);
+  qf_destroy(&qf);
+
+  /* Keep inserting through an incremental expansion. */
+  assert(qf_init(&qf, q, r));
+  for (uint32_t j = 0; j < n; ++j) {
+    qf_insert(&qf, mix64(j));
+  }
+  gettimeofday(&tv1, NULL);
+  assert(qf_expand_begin(&qf));
+  gettimeofday(&tv2, NULL);
+  printf("  qf_expand_begin %llu ms", usecs(&tv1, &tv2) / 1000);
+  uint64_t worst = 0;
+  uint32_t j;
+  for (j = n; qf.qf_old; ++j) {
+    gettimeofday(&tv1, NULL);
+    qf_insert(&qf, mix64(j));
+    gettimeofday(&tv2, NULL);
+    worst = max(worst, usecs(&tv1, &tv2));
+  }
+  printf(", then %u inserts of at most %llu us\n", j - n, worst);
+  fflush(stdout);
+  qf_destroy(&qf);
+  qf_destroy(&big);
+}
+
+/*
+ * Compare qf_truncate_remainders() with re-inserting every hash into a filter
+ * of the narrower width, for a cut that merges streams and one that sorts.
+ */
+static void qf_bench_truncate()
+{
+  const uint32_t q = 22;
+  const uint32_t r = 10;
+  const uint32_t n = 9 * (1 << q) / 10;
+  const uint32_t widths[] = {8, 2};
+
+  for (uint32_t i = 0; i < 2; ++i) {
+    struct quotient_filter qf, ref;
+    struct timeval tv1, tv2, tv3;
+
+    assert(qf_init(&qf, q, r));
+    for (uint32_t j = 0; j < n; ++j) {
+      qf_insert(&qf, mix64(j));
+    }
+
+    gettimeofday(&tv1, NULL);
+    assert(qf_init(&ref, q, widths[i]));
+    for (uint32_t j = 0; j < n; ++j) {
+      qf_insert(&ref, mix64(j));
+    }
+    gettimeofday(&tv2, NULL);
+    assert(qf_truncate_remainders(&qf, widths[i]));
+    gettimeofday(&tv3, NULL);
+
+    printf("q=%u, r=%u to %u: qf_insert %llu ms, "
+        "qf_truncate_remainders %llu ms\n", q, r, widths[i],
+        usecs(&tv1, &tv2) / 1000, usecs(&tv2, &tv3) / 1000);
+    fflush(stdout);
+    qf_destroy(&qf);
+    qf_destroy(&ref);
+  }
+}
+
+/*
+ * Fill a small QF which grows by itself, by each policy, and for comparison
+ * a QF sized for the hashes up front, up to 98% full. Report the total time,
+ * the mean time of the last 1/8 of the inserts, and the slowest insert.
+ */
+static void qf_bench_grow()
+{
+  const uint32_t n = 1 << 22;
+  const char *names[] = {"QF_GROW_AT_ONCE", "QF_GROW_INCREMENTAL",
+    "no growth, q=22"};
+  const uint8_t policies[] = {QF_GROW_AT_ONCE, QF_GROW_INCREMENTAL};
+
+  for (uint32_t i = 0; i < 3; ++i) {
+    struct quotient_filter qf;
+    uint32_t count = n;
+    if (i < 2) {
+      assert(qf_init(&qf, 10, 22));
+      qf.qf_max_load = 0.85;
+      qf.qf_grow_policy = policies[i];
+    } else {
+      assert(qf_init(&qf, 22, 10));
+      count = 98 * (uint64_t) n / 100;
+    }
+
+    struct timeval tv1, tv2, start, tail;
+    uint64_t worst = 0;
+    gettimeofday(&start, NULL);
+    for (uint32_t j = 0; j < count; ++j) {
+      if (j == count - count / 8) {
+        gettimeofday(&tail, NULL);
+      }
+      gettimeofday(&tv1, NULL);
+      assert(qf_insert(&qf, mix64(j)));
+      gettimeofday(&tv2, NULL);
+      worst = max(worst, usecs(&tv1, &tv2));
+    }
+    printf("%s: %u inserts in %llu ms, last 1/8 %.0f ns each, "
+        "at most %llu us, %u growths\n", names[i], count,
+        usecs(&start, &tv2) / 1000,
+        1000.0 * usecs(&tail, &tv2) / (count / 8), worst, qf.qf_grows);
+    fflush(stdout);
+    qf_destroy(&qf);
+  }
+}
+
+/* Compare vector and scalar run scans, on long runs from skewed hashes. */
+static void qf_bench_runs()
+{
+  const uint32_t q = 16;
+  const uint32_t nlookups = 10000000;
+  const struct {
+    const char *name;
+    uint32_t r;
+    uint32_t flags;
+  } configs[] = {
+    {"packed", 10, 0},
+    {"blocked", 10, QF_BLOCKED},
+    {"planes", 10, QF_PLANES},
+  };
+
+  if (!cpu_avx2) {
+    puts("No AVX2, skipping the run scan comparison.");
+    return;
+  }
+  for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i) {
+    struct quotient_filter qf;
+    struct timeval tv1, tv2;
+    uint32_t r = configs[i].r;
+    uint64_t t[2];
+
+    /* Only every 32nd quotient is used, so runs average ~28 entries. */
+    uint64_t mask = LOW_MASK(q + r) & ~(LOW_MASK(5) << r);
+    assert(qf_init_flags(&qf, q, r, configs[i].flags));
+    for (uint64_t j = 0; qf.qf_entries < 9 * (1 << q) / 10; ++j) {
+      qf_insert(&qf, mix64(j) & mask);
+    }
+    for (int avx2 = 0; avx2 < 2; ++avx2) {
+      cpu_avx2 = avx2;
+      gettimeofday(&tv1, NULL);
+      for (uint32_t j = 0; j < nlookups; ++j) {
+        bench_hits += qf_may_contain(&qf, mix64(~(uint64_t) j) & mask);
+      }
+      gettimeofday(&tv2, NULL);
+      t[avx2] = usecs(&tv1, &tv2);
+    }
+    qf_destroy(&qf);
+
+    printf("long runs %s (r=%u): %llu ms AVX2, %llu ms scalar, "
+        "%.2fx speedup\n", configs[i].name, r, t[1] / 1000, t[0] / 1000,
+        double(t[0]) / double(t[1]));
+    fflush(stdout);
+  }
+}
+
+/* Compare single and batched lookups on a table much larger than the cache. */
+static void qf_bench_batch()
+{
+  const uint32_t q = 26;
+  const uint32_t r = 10;
+  const uint32_t nlookups = 10000000;
+  const uint32_t batch = 1000;
+  const uint32_t dists[] = {0, 4, 8, 16, 32, 64};
+  const uint32_t layouts[] = {0, QF_BLOCKED, QF_PLANES};
+  const char *names[] = {"packed", "blocked", "planes"};
+
+  vector<uint64_t> hashes(batch);
+  vector<uint64_t> out(batch / 64 + 1);
+  for (uint32_t i = 0; i < 3; ++i) {
+    struct quotient_filter qf;
+    struct timeval tv1, tv2;
+
+    assert(qf_init_flags(&qf, q, r, layouts[i]));
+    for (uint64_t j = 0; qf.qf_entries < 3 * (1 << q) / 4; ++j) {
+      qf_insert(&qf, mix64(j));
+    }
+
+    gettimeofday(&tv1, NULL);
+    for (uint32_t j = 0; j < nlookups; ++j) {
+      bench_hits += qf_may_contain(&qf, mix64(~(uint64_t) j));
+    }
+    gettimeofday(&tv2, NULL);
+    printf("%s lookups: %.1f ns single", names[i],
+        1000.0 * usecs(&tv1, &tv2) / nlookups);
+
+    for (size_t d = 0; d < sizeof(dists) / sizeof(dists[0]); ++d) {
+      qf.qf_prefetch = dists[d];
+      gettimeofday(&tv1, NULL);
+      for (uint32_t j = 0; j < nlookups; j += batch) {
+        for (uint32_t k = 0; k < batch; ++k) {
+          hashes[k] = mix64(~(uint64_t) (j + k));
+        }
+        qf_may_contain_batch(&qf, &hashes[0], batch, &out[0]);
+        bench_hits += out[0];
+      }
+      gettimeofday(&tv2, NULL);
+      printf(", %.1f ns batch/%u", 1000.0 * usecs(&tv1, &tv2) / nlookups,
+          dists[d]);
+    }
+    printf("\n");
+    fflush(stdout);
+    qf_destroy(&qf);
+  }
+}
+
+/* Compare the BMI2 run search against the portable one. */
+static void qf_bench_dispatch()
+{
+  const uint32_t q = 22;
+  const uint32_t ninserts = 9 * (1 << q) / 10;
+  const uint32_t nlookups = 4000000;
+  const struct {
+    const char *name;
+    uint32_t r;
+    uint32_t flags;
+  } configs[] = {
+    {"packed", 10, 0},
+    {"aligned", 13, 0},
+    {"blocked", 10, QF_BLOCKED},
+    {"planes", 10, QF_PLANES},
+  };
+
+  if (!cpu_bmi2) {
+    puts("No BMI2, skipping the run search comparison.");
+    return;
+  }
+  for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i) {
+    struct quotient_filter qf;
+    uint64_t t[2];
+
+    for (int bmi2 = 0; bmi2 < 2; ++bmi2) {
+      cpu_bmi2 = bmi2;
+      assert(qf_init_flags(&qf, q, configs[i].r, configs[i].flags));
+      t[bmi2] = bench_ops(&qf, ninserts, nlookups);
+      qf_destroy(&qf);
+    }
+
+    printf("90%% load %s (r=%u): %llu ms BMI2, %llu ms portable, "
+        "%.2fx speedup\n", configs[i].name, configs[i].r, t[1] / 1000,
+        t[0] / 1000, double(t[0]) / double(t[1]));
+    fflush(stdout);
+  }
+}
+
+static void qf_bench()
+{
+  struct quotient_filter qf;
+  const uint32_t q_large = 28;
+  const uint32_t q_small = 16;
+  const uint32_t nlookups = 1000000;
+  struct timeval tv1, tv2;
+  uint64_t sec;
+
+  /* Test random inserts + lookups. */
+  uint32_t ninserts = (3 * (1 << q_large) / 4);
+  printf("Testing %u random inserts and %u lookups", ninserts, nlookups);
+  fflush(stdout);
+  qf_init(&qf, q_large, 1);
+  gettimeofday(&tv1, NULL);
+  while (qf.qf_entries < ninserts) {
+    assert(qf_insert(&qf, (uint64_t) rand()));
+    if (qf.qf_entries % 10000000 == 0) {
+      printf(".");
+      fflush(stdout);
+    }
+  }
+  for (uint32_t i = 0; i < nlookups; ++i) {
+    qf_may_contain(&qf, (uint64_t) rand());
+  }
+  gettimeofday(&tv2, NULL);
+  sec = tv2.tv_sec - tv1.tv_sec;
+  printf(" done (%llu seconds).\n", sec);
+  fflush(stdout);
+  qf_destroy(&qf);
+
+  /* Create a large cluster. Test random lookups. */
+  qf_init(&qf, q_small, 1);
+  printf("Testing %u contiguous inserts and %u lookups", 1 << q_small,
+      nlookups);
+  fflush(stdout);
+  gettimeofday(&tv1, NULL);
+  for (uint64_t quot = 0; quot < (1 << (q_small - 1)); ++quot) {
+    uint64_t hash = quot << 1;
+    assert(qf_insert(&qf, hash));
+    assert(qf_insert(&qf, hash | 1));
+    if (quot % 2000 == 0) {
+      printf(".");
+      fflush(stdout);
+    }
+  }
+  for (uint32_t i = 0; i < nlookups; ++i) {
+    qf_may_contain(&qf, (uint64_t) rand());
+    if (i % 50000 == 0) {
+      printf(".");
+      fflush(stdout);
+    }
+  }
+  gettimeofday(&tv2, NULL);
+  sec = tv2.tv_sec - tv1.tv_sec;
+  printf(" done (%llu seconds).\n", sec);
+  fflush(stdout);
+  qf_destroy(&qf);
+
+  /* Compare slot accessors for byte-aligned widths. */
+  qf_bench_widths();
+
+  /* Compare compile-time and runtime filter shapes. */
+  qf_bench_template<22, 10>();
+  qf_bench_template<22, 13>();
+
+  /* Compare table allocation strategies. */
+  qf_bench_hugepages();
+
+  /* Time cluster shifting at high load. */
+  qf_bench_churn();
+
+  /* Count repeated keys, against storing each one once. */
+  qf_bench_counting();
+
+  /* Compare run search implementations. */
+  qf_bench_dispatch();
+
+  /* Compare run scan implementations. */
+  qf_bench_runs();
+
+  /* Compare single and batched lookups. */
+  qf_bench_batch();
+
+  /* Compare filter construction by inserts and by bulk loading. */
+  qf_bench_bulk_load();
+
+  /* Compare streaming and insert-based merges. */
+  qf_bench_merge();
+
+  /* Compare k-way and pairwise merges. */
+  qf_bench_merge_many();
+
+  /* Compare in-place unions with merges and inserts. */
+  qf_bench_union_into();
+
+  /* Compare doubling in place with rebuilding from the hashes. */
+  qf_bench_expand();
+
+  /* Compare filters which grow as they fill with one that fills up. */
+  qf_bench_grow();
+
+  /* Compare narrowing remainders with rebuilding from the hashes. */
+  qf_bench_truncate();
+}
+
+int main()
+{
+  srand(0);
+
+#if QBENCH
+  qf_bench();
+#else
+  for (uint32_t q = 1; q <= Q_MAX; ++q) {
+    printf("Starting rounds for qf_test::q=%u\n", q);
+
+#pragma omp parallel for
+    for (uint32_t r = 1; r <= R_MAX; ++r) {
+      struct quotient_filter qf;
+      if (!qf_init(&qf, q, r)) {
+        fail(&qf, "init-1");
+      }
+      qf_test(&qf);
+      qf_destroy(&qf);
+    }
+  }
+
+  /* Exercise the 16 and 32-bit slot accessors (r = 5 is covered above). */
+  const uint32_t aligned_r[] = {13, 29};
+  for (uint32_t q = 1; q <= Q_MAX; ++q) {
+    printf("Starting rounds for qf_test::q=%u (aligned slots)\n", q);
+
+#pragma omp parallel for
+    for (uint32_t i = 0; i < 2; ++i) {
+      struct quotient_filter qf;
+      if (!qf_init(&qf, q, aligned_r[i])) {
+        fail(&qf, "init-aligned");
+      }
+      qf_test(&qf);
+      qf_destroy(&qf);
+    }
+  }
+
+  /* Exercise mmap()ed tables; the hugetlbfs pool may well be empty. */
+  const uint32_t alloc_flags[] = {QF_HUGEPAGES | QF_PREFAULT, QF_HUGETLB};
+  for (uint32_t i = 0; i < 2; ++i) {
+    struct quotient_filter qf;
+    printf("Starting rounds for qf_test (alloc flags %#x)\n", alloc_flags[i]);
+    if (qf_init_flags(&qf, Q_MAX, R_MAX, alloc_flags[i])) {
+      qf_test(&qf);
+      qf_destroy(&qf);
+    } else if (alloc_flags[i] != QF_HUGETLB) {
+      fail(&qf, "init-alloc");
+    }
+  }
+
+  const uint32_t layouts[] = {0, QF_BLOCKED, QF_PLANES};
+  for (uint32_t q = 1; q <= Q_MAX; ++q) {
+    printf("Starting rounds for qf_test_nowrap::q=%u\n", q);
+
+#pragma omp parallel for
+    for (uint32_t r = 1; r <= R_MAX; ++r) {
+      qf_test_nowrap(q, r, layouts[r % 3]);
+    }
+  }
+  for (uint32_t i = 0; i < 3; ++i) {
+    qf_test_nowrap_tail(layouts[i]);
+  }
+
+  puts("Starting rounds for qf_test_long_runs");
+  const uint32_t run_widths[] = {1, 5, 10, 13, 29, 45, 57, 58};
+  for (uint32_t i = 0; i < sizeof(run_widths) / sizeof(run_widths[0]); ++i) {
+    for (uint32_t j = 0; j < 3; ++j) {
+      qf_test_long_runs(run_widths[i], layouts[j]);
+      qf_test_long_runs(run_widths[i], layouts[j] | QF_NOWRAP);
+    }
+  }
+
+  for (uint32_t q = 1; q <= Q_MAX; ++q) {
+    printf("Starting rounds for qf_test_bulk_load::q=%u\n", q);
+
+#pragma omp parallel for
+    for (uint32_t r = 1; r <= R_MAX; ++r) {
+      qf_test_bulk_load(q, r, layouts[r % 3]);
+      qf_test_bulk_load(q, r, layouts[q % 3] | QF_NOWRAP);
+    }
+  }
+  qf_test_bulk_load(10, 13, 0);
+  qf_test_bulk_load(12, 29, 0);
+
+  for (uint32_t q = 1; q <= Q_MAX; ++q) {
+    printf("Starting rounds for qf_test_merge_into::q=%u\n", q);
+
+#pragma omp parallel for
+    for (uint32_t r = 1; r <= R_MAX; ++r) {
+      qf_test_merge_into(q, r, layouts[r % 3]);
+      qf_test_merge_into(q, r, layouts[q % 3] | QF_NOWRAP);
+    }
+  }
+
+  for (uint32_t q = 1; q <= Q_MAX; ++q) {
+    printf("Starting rounds for qf_test_union_into::q=%u\n", q);
+#pragma omp parallel for
+    for (uint32_t r = 1; r <= R_MAX; ++r) {
+      qf_test_union_into(q, r, layouts[r % 3]);
+      qf_test_union_into(q, r, layouts[q % 3] | QF_NOWRAP);
+    }
+  }
+  for (uint32_t i = 0; i < 3; ++i) {
+    qf_test_union_into(3, 7, layouts[i]);
+  }
+
+  for (uint32_t q = 1; q <= Q_MAX; ++q) {
+    printf("Starting rounds for qf_test_expand::q=%u\n", q);
+#pragma omp parallel for
+    for (uint32_t r = 1; r <= R_MAX; ++r) {
+      qf_test_expand(q, r, layouts[r % 3]);
+      qf_test_expand(q, r, layouts[q % 3] | QF_NOWRAP);
+    }
+  }
+
+  for (uint32_t q = 1; q <= Q_MAX; ++q) {
+    printf("Starting rounds for qf_test_truncate::q=%u\n", q);
+    /* Drop more than TRUNCATE_MERGE_BITS too. */
+#pragma omp parallel for
+    for (uint32_t r = 1; r <= R_MAX + 1; ++r) {
+      uint32_t width = (r > R_MAX) ? 13 : r;
+      qf_test_truncate(q, width, layouts[(q + r) % 3]);
+      qf_test_truncate(q, width, layouts[r % 3] | QF_NOWRAP);
+    }
+  }
+
+  for (uint32_t q = 1; q <= Q_MAX; ++q) {
+    printf("Starting rounds for qf_test_shrink::q=%u\n", q);
+#pragma omp parallel for
+    for (uint32_t r = 1; r <= R_MAX; ++r) {
+      qf_test_shrink(q, r, layouts[(q + r) % 3]);
+      qf_test_shrink(q, r, layouts[r % 3] | QF_NOWRAP);
+    }
+  }
+
+  for (uint32_t q = 1; q <= Q_MAX; ++q) {
+    printf("Starting rounds for qf_test_expand_begin::q=%u\n", q);
+#pragma omp parallel for
+    for (uint32_t r = 2; r <= R_MAX; ++r) {
+      qf_test_expand_begin(q, r, layouts[(q + r) % 3]);
+    }
+  }
+
+  for (uint32_t q = 1; q <= Q_MAX; q += 3) {
+    printf("Starting rounds for qf_test_grow::q=%u\n", q);
+#pragma omp parallel for
+    for (uint32_t r = 2; r <= R_MAX; ++r) {
+      qf_test_grow(q, r, layouts[(q + r) % 3]);
+      qf_test_grow(q, r, layouts[r % 3] | QF_NOWRAP);
+    }
+  }
+
+  for (uint32_t q = 1; q <= Q_MAX; q += 2) {
+    printf("Starting rounds for qf_test_expandable::q=%u\n", q);
+#pragma omp parallel for
+    for (uint32_t r = 2; r <= R_MAX; ++r) {
+      qf_test_expandable(q, r, layouts[(q + r) % 3]);
+      qf_test_expandable(q, r, layouts[r % 3] | QF_NOWRAP);
+    }
+  }
+
+  for (uint32_t q = 2; q <= Q_MAX; q += 2) {
+    printf("Starting rounds for qf_test_counting::q=%u\n", q);
+#pragma omp parallel for
+    for (uint32_t r = 2; r <= R_MAX; ++r) {
+      qf_test_counting(q, r, layouts[(q + r) % 3]);
+      qf_test_counting(q, r, layouts[r % 3] | QF_NOWRAP);
+    }
+  }
+
+  for (uint32_t q = 2; q <= Q_MAX; ++q) {
+    printf("Starting rounds for qf_test_split::q=%u\n", q);
+#pragma omp parallel for
+    for (uint32_t r = 1; r <= R_MAX; ++r) {
+      qf_test_split(q, r, layouts[r % 3]);
+      qf_test_split(q, r, layouts[q % 3] | QF_NOWRAP);
+    }
+  }
+
+  puts("Starting rounds for qf_test_merge_many");
+  for (uint32_t i = 0; i < 3; ++i) {
+    qf_test_merge_many(layouts[i]);
+  }
+
+  puts("Starting rounds for qf_test_merge_parallel");
+  for (uint32_t i = 0; i < 3; ++i) {
+    qf_test_merge_parallel(layouts[i]);
+    qf_test_merge_parallel(layouts[i] | QF_NOWRAP);
+  }
+
+  puts("Starting rounds for qf_test_dispatch");
+  qf_test_dispatch();
+
+  /* Rerun some rounds on the portable searches, whatever the CPU. */
+  bool bmi2 = cpu_bmi2;
+  bool avx2 = cpu_avx2;
+  cpu_bmi2 = cpu_avx2 = false;
+  for (uint32_t q = 1; q <= Q_MAX; q += 4) {
+    printf("Starting rounds for qf_test::q=%u (portable search)\n", q);
+    for (uint32_t r = 1; r <= R_MAX; r += 7) {
+      struct quotient_filter qf;
+      if (!qf_init(&qf, q, r)) {
+        fail(&qf, "init-portable");
+      }
+      qf_test(&qf);
+      qf_destroy(&qf);
+    }
+  }
+  qf_core::cpu_bmi2 = qf_core::cpu_avx2 = false;
+  qf_test_template<10, 6>();
+  qf_core::cpu_bmi2 = bmi2;
+  qf_core::cpu_avx2 = avx2;
+  cpu_bmi2 = bmi2;
+  cpu_avx2 = avx2;
+
+  puts("Starting rounds for qf_test_template");
+  qf_test_template<1, 1>();
+  qf_test_template<4, 3>();
+  qf_test_template<8, 5>();
+  qf_test_template<10, 6>();
+  qf_test_template<11, 13>();
+  qf_test_template<12, 29>();
+  qf_test_template<3, 60>();
+
+  for (uint32_t q1 = 1; q1 <= Q_MAX; ++q1) {
+    for (uint32_t r1 = 1; r1 <= R_MAX; ++r1) {
+      for (uint32_t q2 = 1; q2 <= Q_MAX; ++q2) {
+        printf("Starting rounds for qf_merge::q1=%u,q2=%u\n", q1, q2);
+
+#pragma omp parallel for
+        for (uint32_t r2 = 1; r2 <= R_MAX; ++r2) {
+          struct quotient_filter qf;
+          struct quotient_filter qf1, qf2;
+          if (!qf_init(&qf1, q1, r1) || !qf_init(&qf2, q2, r2)) {
+            fail(&qf1, "init-2");
+          }
+
+          random_fill(&qf1);
+          random_fill(&qf2);
+          if (qf_merge(&qf1, &qf2, &qf)) {
+            qf_consistent(&qf);
+            subsetof(&qf1, &qf);
+            subsetof(&qf2, &qf);
+            supersetof(&qf, &qf1, &qf2);
+            qf_destroy(&qf);
+          } else {
+            /* The union overflows the narrower fingerprints' space. */
+            uint32_t w = min(q1 + r1, q2 + r2);
+            set<uint64_t> fps;
+            fingerprints(&qf1, w, fps);
+            fingerprints(&qf2, w, fps);
+            assert(fps.size() > (1ULL << (w - 1)));
+          }
           qf_destroy(&qf1);
           qf_destroy(&qf2);
-          qf_destroy(&qf);
         }
       }
     }